@@ -167,42 +167,37 @@ void dcfemDomainAssembleStiffnessMatrix(SparseMatrix < ValueType > & S, const Me
     S.clean();
     uint countRho0 = 0, countforcedHomDirichlet = 0;
 
-    if (!S.valid()) S.buildSparsityPattern(mesh);
-
-    ElementMatrix < double > Se, Stmp;
+    if (!S.valid()) S.buildSparsityPattern(mesh, true);
+    else if (!S.hasScatterMap(mesh)) S.buildScatterMap(mesh);
 
     if (atts.size() != mesh.cellCount()){
        throwLengthError(WHERE_AM_I + " attribute size missmatch" + str(atts.size())
                        + " != " + str(mesh.cellCount()));
     }
-    ValueType rho = 0.0;
     Stopwatch swatch(true);
-    //unsigned long sCount = 0;
 
-    for (uint i = 0; i < mesh.cellCount(); i++){
-        rho = atts[mesh.cell(i).id()];
+    S.assembleCells(mesh, [&](const Cell & cell, ElementMatrix < double > & Se,
+                              ElementMatrix < double > & Stmp,
+                              ValueType & scale) -> bool {
+        ValueType rho = atts[cell.id()];
         //** rho == 0.0 may happen while secondary field assemblation
-        if (GIMLI::abs(rho) > TOLERANCE){
-            if (k > 0.0){
-//             Stmp = Se.u2(mesh.cell(i));
-//             Stmp *= k * k;
-//             Stmp += Se.ux2uy2uz2(mesh.cell(i));
-
-                Stopwatch s(true);
-                Se.u2(mesh.cell(i));
-                //sCount += s.cycleCounter().toc();
-                Se *= k * k;
-                Se += Stmp.ux2uy2uz2(mesh.cell(i));
-            } else {
-                Se.ux2uy2uz2(mesh.cell(i));
-            }
-	S.add(Se, 1./rho);
-//             Se *= 1.0 / rho;
-//             S += Se;
+        if (!(GIMLI::abs(rho) > TOLERANCE)) return false;
+
+        if (k > 0.0){
+            Se.u2(cell);
+            Se *= k * k;
+            Se += Stmp.ux2uy2uz2(cell);
         } else {
-            //std::cout << WHERE_AM_I << " " << rho << std::endl;
+            Se.ux2uy2uz2(cell);
+        }
+        scale = 1./rho;
+        return true;
+    });
+
+    if (fix){
+        for (uint i = 0; i < mesh.cellCount(); i++){
+            if (atts[mesh.cell(i).id()] < ValueType(0.0)) countRho0++;
         }
-        if (rho < ValueType(0.0) && fix) countRho0++;
     }
 
     //std::cout << "assemble time: " << swatch.cycleCounter().toc() << " " << sCount << "  " << swatch.duration()  << std::endl;
@@ -248,6 +243,8 @@ void dcfemBoundaryAssembleStiffnessMatrix(SparseMatrix < ValueType > & S,
                                           double k){
     ElementMatrix < double > Se;
     std::set < Node * > homDirNodes;
+    if (S.valid() && !S.hasScatterMap(mesh)) S.buildScatterMap(mesh);
+
     for (Index i = 0, imax = mesh.boundaryCount(); i < imax; i++){
         int marker = mesh.boundary(i).marker();
         if (marker < 0){
@@ -273,7 +270,7 @@ void dcfemBoundaryAssembleStiffnessMatrix(SparseMatrix < ValueType > & S,
                     std::cerr << WHERE_AM_I << " parameter rho == 0.0 found " << rho << std::endl;
                 }
                 Se.u2(mesh.boundary(i));
-                S.add(Se, (mixedBoundaryCondition(mesh.boundary(i), source, k) / rho));
+                S.addBoundary(i, Se, (mixedBoundaryCondition(mesh.boundary(i), source, k) / rho));
                 //Se *= (mixedBoundaryCondition(mesh.boundary(i), source, k) / rho);
                 // S += Se;
             } break;
@@ -1776,7 +1773,7 @@ void DCMultiElectrodeModelling::calculateK_(const std::vector < ElectrodeShape *
     if (debug) std::cout << "Building sparsity pattern ... " ;
 
     SparseMatrix < ValueType > S_;
-    S_.buildSparsityPattern(*mesh_);
+    S_.buildSparsityPattern(*mesh_, true);
 
 // MEMINFO
 
@@ -2172,7 +2169,7 @@ void DCSRMultiElectrodeModelling::calculateK(const std::vector < ElectrodeShape
 // MEMINFO
 
     RSparseMatrix S_;
-    S_.buildSparsityPattern(*mesh_);
+    S_.buildSparsityPattern(*mesh_, true);
     bool singleVerbose = verbose_;
 
 // MEMINFO
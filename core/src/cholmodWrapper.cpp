@@ -27,6 +27,9 @@
     #include <cholmod.h>
     #define USE_CHOLMOD 1
 
+    // cholmod_* for 32 bit or cholmod_l_* for 64 bit index arrays
+    #define CHOLMOD_CALL(fun) (useLong_ ? cholmod_l_##fun : cholmod_##fun)
+
     #if defined(UMFPACK_FOUND)
         #if (UMFPACK_FOUND == TRUE)
             #include <umfpack.h>
@@ -58,6 +61,7 @@ CHOLMODWrapper::CHOLMODWrapper(RSparseMatrix & S, bool verbose, int stype,
     Ai_ = NULL;
     ApR_ = NULL;
     AiR_ = NULL;
+    useLong_ = false;
     setMatrix(S);
 }
 CHOLMODWrapper::CHOLMODWrapper(CSparseMatrix & S, bool verbose, int stype,
@@ -74,6 +78,39 @@ CHOLMODWrapper::CHOLMODWrapper(CSparseMatrix & S, bool verbose, int stype,
     Ai_ = NULL;
     ApR_ = NULL;
     AiR_ = NULL;
+    useLong_ = false;
+    setMatrix(S);
+}
+CHOLMODWrapper::CHOLMODWrapper(RSparseMatrix64 & S, bool verbose, int stype)
+    : SolverWrapper(verbose), stype_(stype), forceUmfpack_(false){
+    Numeric_ = nullptr;
+    NumericD_= nullptr;
+    c_ = NULL;
+    A_ = NULL;
+    L_ = NULL;
+    AxV_ = NULL;
+    AzV_ = NULL;
+    Ap_ = NULL;
+    Ai_ = NULL;
+    ApR_ = NULL;
+    AiR_ = NULL;
+    useLong_ = true;
+    setMatrix(S);
+}
+CHOLMODWrapper::CHOLMODWrapper(CSparseMatrix64 & S, bool verbose, int stype)
+    : SolverWrapper(verbose), stype_(stype), forceUmfpack_(false){
+    Numeric_ = nullptr;
+    NumericD_= nullptr;
+    c_ = NULL;
+    A_ = NULL;
+    L_ = NULL;
+    AxV_ = NULL;
+    AzV_ = NULL;
+    Ap_ = NULL;
+    Ai_ = NULL;
+    ApR_ = NULL;
+    AiR_ = NULL;
+    useLong_ = true;
     setMatrix(S);
 }
 
@@ -83,11 +120,12 @@ CHOLMODWrapper::~CHOLMODWrapper(){
 
 void CHOLMODWrapper::free(){
 #if USE_CHOLMOD
-    if (L_) cholmod_free_factor((cholmod_factor**)(&L_), (cholmod_common*)c_);
+    if (L_) CHOLMOD_CALL(free_factor)((cholmod_factor**)(&L_), (cholmod_common*)c_);
+    L_ = nullptr;
 //     ** We did not allocate the matrix so we dont need to free it
 //      cholmod_free_sparse(&A_, c_);
 
-    cholmod_finish((cholmod_common*)c_);
+    if (c_) CHOLMOD_CALL(finish)((cholmod_common*)c_);
 
     if (A_) delete (cholmod_sparse*)A_;
     A_ = nullptr;
@@ -112,6 +150,9 @@ void CHOLMODWrapper::free(){
     if (AiR_) delete [] AiR_;
     AiR_ = nullptr;
 
+    std::vector< SIndex >().swap(ApL_);
+    std::vector< SIndex >().swap(AiL_);
+
 #else
     std::cerr << WHERE_AM_I << " cholmod not installed" << std::endl;
 #endif
@@ -125,9 +166,17 @@ void CHOLMODWrapper::setMatrix(CSparseMatrix & S){
     this->free();
     init_(S, stype_);
 }
+void CHOLMODWrapper::setMatrix(RSparseMatrix64 & S){
+    this->free();
+    init_(S, stype_);
+}
+void CHOLMODWrapper::setMatrix(CSparseMatrix64 & S){
+    this->free();
+    init_(S, stype_);
+}
 
-template < class ValueType >
-void CHOLMODWrapper::init_(SparseMatrix < ValueType > & S, int stype){
+template < class ValueType, class IndexType >
+void CHOLMODWrapper::init_(SparseMatrix < ValueType, IndexType > & S, int stype){
 
     dim_ = S.size();
     nVals_ = S.nVals();
@@ -144,6 +193,8 @@ void CHOLMODWrapper::init_(SparseMatrix < ValueType > & S, int stype){
     Ai_ = NULL;
     ApR_ = NULL;
     AiR_ = NULL;
+    // small problems keep 32 bit indices, see factorise_ for the switch
+    useLong_ = sizeof(IndexType) > sizeof(int);
 
     if (stype == -2){
         stype_ = S.stype();
@@ -154,7 +205,7 @@ void CHOLMODWrapper::init_(SparseMatrix < ValueType > & S, int stype){
 #if USE_CHOLMOD
     int ret = 0;
     c_ = new cholmod_common;
-    ret =  cholmod_start((cholmod_common*)c_);
+    ret =  CHOLMOD_CALL(start)((cholmod_common*)c_);
     if (ret) dummy_ = false;
     initializeMatrix_(S);
 #elif USE_UMFPACK
@@ -305,8 +356,30 @@ int CHOLMODWrapper::initializeMatrix_(RSparseMatrix & S){
     return 0;
 }
 
-template < class ValueType >
-int CHOLMODWrapper::initMatrixChol_(SparseMatrix < ValueType > & S, int xType){
+int CHOLMODWrapper::initializeMatrix_(RSparseMatrix64 & S){
+    if (!dummy_){
+#if USE_CHOLMOD
+        // no umfpack for 64 bit indices, cholmod factorizes A*A^T for
+        // nonsymmetric matrices
+        name_ = "Cholmod";
+        return initMatrixChol_(S, CHOLMOD_REAL);
+#endif
+    }
+    return 0;
+}
+
+int CHOLMODWrapper::initializeMatrix_(CSparseMatrix64 & S){
+    if (!dummy_){
+#if USE_CHOLMOD
+        name_ = "Cholmod";
+        return initMatrixChol_(S, CHOLMOD_COMPLEX);
+#endif
+    }
+    return 0;
+}
+
+template < class ValueType, class IndexType >
+int CHOLMODWrapper::initMatrixChol_(SparseMatrix < ValueType, IndexType > & S, int xType){
     if (!dummy_){
 #if USE_CHOLMOD
 
@@ -320,7 +393,7 @@ int CHOLMODWrapper::initMatrixChol_(SparseMatrix < ValueType > & S, int xType){
         ((cholmod_sparse*)A_)->x     = S.vals();     /* numerical values, size nzmax */
         ((cholmod_sparse*)A_)->stype = stype_;
 
-        ((cholmod_sparse*)A_)->itype = CHOLMOD_INT;
+        ((cholmod_sparse*)A_)->itype = useLong_ ? CHOLMOD_LONG : CHOLMOD_INT;
         ((cholmod_sparse*)A_)->xtype = xType;  // data type for the pattern (Real, complex, zcomplex)
         ((cholmod_sparse*)A_)->dtype = CHOLMOD_DOUBLE; // data type for complex or real (float/double)
         ((cholmod_sparse*)A_)->packed = true;
@@ -334,6 +407,23 @@ int CHOLMODWrapper::initMatrixChol_(SparseMatrix < ValueType > & S, int xType){
     return 0;
 }
 
+void CHOLMODWrapper::switchToLong_(){
+#if USE_CHOLMOD
+    cholmod_sparse * A = (cholmod_sparse*)A_;
+    const int * Ap = (const int *)A->p;
+    const int * Ai = (const int *)A->i;
+    ApL_.assign(Ap, Ap + A->ncol + 1);
+    AiL_.assign(Ai, Ai + Ap[A->ncol]);
+    A->p = &ApL_[0];
+    A->i = AiL_.empty() ? 0 : &AiL_[0];
+    A->itype = CHOLMOD_LONG;
+
+    cholmod_finish((cholmod_common*)c_);
+    useLong_ = true;
+    cholmod_l_start((cholmod_common*)c_);
+#endif
+}
+
 int CHOLMODWrapper::factorise_(){
     if (!dummy_){
 #if USE_CHOLMOD
@@ -341,7 +431,7 @@ int CHOLMODWrapper::factorise_(){
              // allready factorized in matrix init;
              //std::cerr << WHERE_AM_I << " factorize for umfpack called" << std::endl;
          } else {
-            if (verbose_) cholmod_print_sparse((cholmod_sparse *)A_, "A", (cholmod_common*)c_);
+            if (verbose_) CHOLMOD_CALL(print_sparse)((cholmod_sparse *)A_, "A", (cholmod_common*)c_);
             // cholmod_print_common("common parameter", (cholmod_common*)c_);
 
 
@@ -356,17 +446,31 @@ int CHOLMODWrapper::factorise_(){
             // ((cholmod_common *)c_)->current=3;
 
 
-            L_ = cholmod_analyze((cholmod_sparse*)A_,
-                                 (cholmod_common*)c_);		    /* analyze */
+            L_ = CHOLMOD_CALL(analyze)((cholmod_sparse*)A_,
+                                       (cholmod_common*)c_);		    /* analyze */
+
+            if (!L_ && !useLong_ &&
+                ((cholmod_common*)c_)->status == CHOLMOD_TOO_LARGE){
+                // the factor of a 32 bit matrix may exceed 2^31 entries
+                if (verbose_) log(Info, "CHOLMOD factor too large for 32 bit "
+                                        "indices .. switching to CHOLMOD_LONG.");
+                switchToLong_();
+                L_ = CHOLMOD_CALL(analyze)((cholmod_sparse*)A_,
+                                           (cholmod_common*)c_);
+            }
+            if (!L_){
+                log(Critical, "CHOLMOD analyze failed with status: ",
+                    ((cholmod_common*)c_)->status);
+            }
             // __MS(((cholmod_factor *)L_)->is_super)
-            cholmod_factorize((cholmod_sparse*)A_,
-                              (cholmod_factor*)L_,
-                              (cholmod_common*)c_);		    /* factorize */
+            CHOLMOD_CALL(factorize)((cholmod_sparse*)A_,
+                                    (cholmod_factor*)L_,
+                                    (cholmod_common*)c_);		    /* factorize */
 
         if (verbose_) std::cout << "CHOLMOD analyzed preordering: "
                                 << ((cholmod_factor *)(L_))->ordering << std::endl;
 
-        if (verbose_) cholmod_print_factor((cholmod_factor *)L_, "L", (cholmod_common*)c_);
+        if (verbose_) CHOLMOD_CALL(print_factor)((cholmod_factor *)L_, "L", (cholmod_common*)c_);
     }
     return 1;
 #else
@@ -383,11 +487,11 @@ template < class ValueType >
     ASSERT_VEC_SIZE(solution, this->dim_)
     if (!dummy_){
 #if USE_CHOLMOD
-        cholmod_dense * b = cholmod_zeros(((cholmod_sparse*)A_)->nrow,
+        cholmod_dense * b = CHOLMOD_CALL(zeros)(((cholmod_sparse*)A_)->nrow,
                                          1,
                                          ((cholmod_sparse*)A_)->xtype,
                                          (cholmod_common*)c_);
-        cholmod_dense * r = cholmod_zeros(((cholmod_sparse*)A_)->nrow,
+        cholmod_dense * r = CHOLMOD_CALL(zeros)(((cholmod_sparse*)A_)->nrow,
                                           1,
                                           ((cholmod_sparse*)A_)->xtype,
                                           (cholmod_common*)c_);
@@ -395,14 +499,14 @@ template < class ValueType >
         ValueType * bx = (ValueType*)b->x;
         for (uint i = 0; i < dim_; i++) bx[i] = rhs[i];
 
-        cholmod_dense * x = cholmod_solve(CHOLMOD_A,
+        cholmod_dense * x = CHOLMOD_CALL(solve)(CHOLMOD_A,
                                           (cholmod_factor *)L_,
                                           b,
                                           (cholmod_common *)c_);       /* solve Ax=b */
 
         if (((cholmod_sparse*)A_)->stype == 0){
             double al[2] = {0,0}, be[2] = {1,0};       /* basic scalars */
-            cholmod_sdmult((cholmod_sparse*)A_, 0, be, al, x, r, (cholmod_common*)c_);
+            CHOLMOD_CALL(sdmult)((cholmod_sparse*)A_, 0, be, al, x, r, (cholmod_common*)c_);
             bx = (ValueType *)r->x; /* ret = Ax */
             for (uint i = 0; i < dim_; i++) solution[i] = conj(bx[i]);
 
@@ -412,9 +516,9 @@ template < class ValueType >
             bx = (ValueType *)x->x; /* ret = x */
             for (uint i = 0; i < dim_; i++) solution[i] = bx[i];
         }
-        cholmod_free_dense(&x, (cholmod_common*)c_);
-        cholmod_free_dense(&r, (cholmod_common*)c_);
-        cholmod_free_dense(&b, (cholmod_common*)c_);
+        CHOLMOD_CALL(free_dense)(&x, (cholmod_common*)c_);
+        CHOLMOD_CALL(free_dense)(&r, (cholmod_common*)c_);
+        CHOLMOD_CALL(free_dense)(&b, (cholmod_common*)c_);
 #else
     std::cerr << WHERE_AM_I << " cholmod not installed" << std::endl;
 #endif
@@ -28,6 +28,8 @@ class DLLEXPORT CHOLMODWrapper : public SolverWrapper {
 public:
     CHOLMODWrapper(RSparseMatrix & S, bool verbose=false, int stype=-2, bool forceUmfpack=false);
     CHOLMODWrapper(CSparseMatrix & S, bool verbose=false, int stype=-2, bool forceUmfpack=false);
+    CHOLMODWrapper(RSparseMatrix64 & S, bool verbose=false, int stype=-2);
+    CHOLMODWrapper(CSparseMatrix64 & S, bool verbose=false, int stype=-2);
 
     virtual ~CHOLMODWrapper();
 
@@ -37,6 +39,17 @@ public:
 
     virtual void setMatrix(CSparseMatrix & S);
 
+    /*! Matrices with 64 bit indices are always factorized by CHOLMOD
+     * using CHOLMOD_LONG. */
+    virtual void setMatrix(RSparseMatrix64 & S);
+
+    virtual void setMatrix(CSparseMatrix64 & S);
+
+    /*! Return true if CHOLMOD works with 64 bit indices, either for
+     * RSparseMatrix64 or CSparseMatrix64 or because the factor of a 32 bit
+     * matrix exceeds the 32 bit index range. */
+    bool longIndex() const { return useLong_; }
+
     virtual void solve(const RVector & rhs, RVector & solution);
 
     virtual void solve(const CVector & rhs, CVector & solution);
@@ -50,11 +63,18 @@ protected:
 
     int initializeMatrix_(CSparseMatrix & S);
 
-    template < class ValueType >
-    void init_(SparseMatrix < ValueType > & S, int stype);
+    int initializeMatrix_(RSparseMatrix64 & S);
 
-    template < class ValueType >
-    int initMatrixChol_(SparseMatrix < ValueType > & S, int xType);
+    int initializeMatrix_(CSparseMatrix64 & S);
+
+    template < class ValueType, class IndexType >
+    void init_(SparseMatrix < ValueType, IndexType > & S, int stype);
+
+    template < class ValueType, class IndexType >
+    int initMatrixChol_(SparseMatrix < ValueType, IndexType > & S, int xType);
+
+    /*! Restart CHOLMOD with 64 bit copies of the 32 bit index arrays. */
+    void switchToLong_();
 
     template < class ValueType >
     void solveCHOL_(const Vector < ValueType > & rhs, Vector < ValueType > & solution);
@@ -70,6 +90,10 @@ protected:
     void *A_;
     void *L_;
 
+    bool useLong_;
+    std::vector< SIndex > ApL_;
+    std::vector< SIndex > AiL_;
+
     bool useUmfpack_;
     bool forceUmfpack_;
     void *Numeric_;
@@ -2082,6 +2082,87 @@ void createForceVectorMult_(const Mesh & mesh, Index order, RVector & ret,
         }
     }
 }
+void fillShapeFunctionCache(const Mesh & mesh){
+    std::set< uint > rttis;
+    for (auto & cell: mesh.cells()){
+        if (rttis.insert(cell->rtti()).second){
+            ShapeFunctionCache::instance().deriveShapeFunctions(*cell, 0);
+            ShapeFunctionCache::instance().deriveShapeFunctions(cell->shape(), 0);
+        }
+    }
+    for (auto & bound: mesh.boundaries()){
+        if (rttis.insert(bound->rtti()).second){
+            ShapeFunctionCache::instance().deriveShapeFunctions(*bound, 0);
+            ShapeFunctionCache::instance().deriveShapeFunctions(bound->shape(), 0);
+        }
+    }
+}
+
+//! Element matrices of a cell range into a build mode buffer.
+template < class Fill >
+class AssembleMapMT : public BaseCalcMT {
+public:
+    AssembleMapMT(const Mesh & mesh, const Fill & fill,
+                  std::vector< RSparseMapMatrix > & buffers)
+    : BaseCalcMT(false), mesh_(&mesh), fill_(&fill), buffers_(&buffers) { }
+
+    virtual ~AssembleMapMT(){}
+
+    virtual void calc(){
+        ElementMatrix < double > A;
+        ElementMatrix < double > tmp;
+        RSparseMapMatrix & B = (*buffers_)[_threadNumber];
+        for (Index i = start_; i < end_; i ++){
+            B.add((*fill_)(*mesh_->cells()[i], A, tmp));
+        }
+    }
+
+protected:
+    const Mesh * mesh_;
+    const Fill * fill_;
+    std::vector< RSparseMapMatrix > * buffers_;
+};
+
+/*! Add the element matrix fill(cell, A, tmp) of every cell to ret.
+ * Large meshes are split into contiguous cell ranges on threadCount()
+ * threads with their own build mode buffers. The buffers are appended in
+ * cell order, so the result equals the serial assembly. */
+template < class Fill >
+void assembleCellsMap_(const Mesh & mesh, RSparseMapMatrix & ret,
+                       const Fill & fill){
+    bool oldMode = ret.buildMode();
+    ret.setBuildMode(true);
+
+    Index nThreads = threadCount();
+    if (mesh.cellCount() < SPARSE_ASSEMBLY_MT_MIN_CELLS) nThreads = 1;
+
+    if (nThreads < 2){
+        ElementMatrix < double > A;
+        ElementMatrix < double > tmp;
+        for (auto &cell: mesh.cells()){
+            ret.add(fill(*cell, A, tmp));
+        }
+    } else {
+        fillShapeFunctionCache(mesh);
+        std::vector< RSparseMapMatrix > buffers(nThreads,
+                                                RSparseMapMatrix(0, 0, ret.stype()));
+        for (auto & B: buffers) B.setBuildMode(true);
+        distributeCalc(AssembleMapMT< Fill >(mesh, fill, buffers),
+                       mesh.cellCount(), nThreads);
+        for (auto & B: buffers) ret.appendBuild(B);
+    }
+    ret.setBuildMode(oldMode);
+}
+
+template < class Vec >
+void checkCellCoefficients_(const Mesh & mesh, const Vec & a){
+    if (a.size() != 1 && a.size() != mesh.cellCount()){
+        __M
+        log(Critical, "Number of cell coefficients (",a.size(),") does not"
+            "match cell count:",  mesh.cellCount());
+    }
+}
+
 template < class Vec >
 void createMassMatrixPerCell_(const Mesh & mesh, Index order,
                               RSparseMapMatrix & ret, const Vec & a,
@@ -2089,23 +2170,22 @@ void createMassMatrixPerCell_(const Mesh & mesh, Index order,
     if (nCoeff > 3){
         log(Critical, "Number of coefficients need to be lower then 4");
     }
-    ElementMatrix < double > uu;
+    checkCellCoefficients_(mesh, a);
 
-    for (auto &cell: mesh.cells()){
-        cell->uCache().pot(*cell, order, true,
-                           nCoeff, mesh.nodeCount(), dofOffset);
+    assembleCellsMap_(mesh, ret, [&](Cell & cell,
+                                     ElementMatrix < double > & uu,
+                                     ElementMatrix < double > & tmp)
+                                     -> const ElementMatrix < double > & {
+        cell.uCache().pot(cell, order, true,
+                          nCoeff, mesh.nodeCount(), dofOffset);
 
         if (a.size() == 1){
-            dot(cell->uCache(), cell->uCache(), a[0], uu);
-        } else if (a.size() == mesh.cellCount()){
-            dot(cell->uCache(), cell->uCache(), a[cell->id()], uu);
+            dot(cell.uCache(), cell.uCache(), a[0], uu);
         } else {
-            __M
-            log(Critical, "Number of cell coefficients (",a.size(),") does not"
-                "match cell count:",  mesh.cellCount());
+            dot(cell.uCache(), cell.uCache(), a[cell.id()], uu);
         }
-        ret.add(uu);
-    }
+        return uu;
+    });
 }
 template < class Vec >
 void createMassMatrixMult_(const Mesh & mesh, Index order,
@@ -2114,25 +2194,24 @@ void createMassMatrixMult_(const Mesh & mesh, Index order,
     if (nCoeff > 3){
         log(Critical, "Number of coefficients need to be lower then 4");
     }
-    ElementMatrix < double > ua;
-    ElementMatrix < double > uau;
+    if (a.size() == 1 && mesh.cellCount() != 1){
+        //** one value for all cells
+        createMassMatrixPerCell_(mesh, order, ret, a[0], nCoeff, dofOffset);
+        return;
+    }
+    checkCellCoefficients_(mesh, a);
 
-    for (auto &cell: mesh.cells()){
-        cell->uCache().pot(*cell, order, true,
-                           nCoeff, mesh.nodeCount(), dofOffset);
+    assembleCellsMap_(mesh, ret, [&](Cell & cell,
+                                     ElementMatrix < double > & uau,
+                                     ElementMatrix < double > & ua)
+                                     -> const ElementMatrix < double > & {
+        cell.uCache().pot(cell, order, true,
+                          nCoeff, mesh.nodeCount(), dofOffset);
 
-        if (a.size() == 1 && mesh.cellCount() != 1){
-            createMassMatrixPerCell_(mesh, order, ret, a[0], nCoeff, dofOffset);
-        } else if (a.size() == mesh.cellCount()){
-            mult(cell->uCache(), a[cell->id()], ua);
-            dot(ua, cell->uCache(), 1.0, uau);
-            ret.add(uau);
-        } else {
-            __M
-            log(Critical, "Number of cell coefficients (",a.size(),") does not"
-                "match cell count:",  mesh.cellCount());
-        }
-    }
+        mult(cell.uCache(), a[cell.id()], ua);
+        dot(ua, cell.uCache(), 1.0, uau);
+        return uau;
+    });
 }
 template < class Vec >
 void createStiffnessMatrixPerCell_(const Mesh & mesh, Index order,
@@ -2143,26 +2222,24 @@ void createStiffnessMatrixPerCell_(const Mesh & mesh, Index order,
         __M;
         log(Critical, "Number of coefficients need to be lower then 4");
     }
+    checkCellCoefficients_(mesh, a);
 
-    ElementMatrix < double > dudu;
-
-    for (auto &cell: mesh.cells()){
+    assembleCellsMap_(mesh, ret, [&](Cell & cell,
+                                     ElementMatrix < double > & dudu,
+                                     ElementMatrix < double > & tmp)
+                                     -> const ElementMatrix < double > & {
         //#bool elastic, bool sum, bool div,
-        cell->gradUCache().grad(*cell, order,
-                                 elastic, false, false,
-                                 nCoeff, mesh.nodeCount(), dofOffset, kelvin);
+        cell.gradUCache().grad(cell, order,
+                               elastic, false, false,
+                               nCoeff, mesh.nodeCount(), dofOffset, kelvin);
 
         if (a.size() == 1){
-            dot(cell->gradUCache(), cell->gradUCache(), a[0], dudu);
-        } else if (a.size() == mesh.cellCount()){
-            dot(cell->gradUCache(), cell->gradUCache(), a[cell->id()], dudu);
+            dot(cell.gradUCache(), cell.gradUCache(), a[0], dudu);
         } else {
-            __M;
-            log(Critical, "Number of cell coefficients (",a.size(),") does not "
-                "match cell count:",  mesh.cellCount());
+            dot(cell.gradUCache(), cell.gradUCache(), a[cell.id()], dudu);
         }
-        ret.add(dudu);
-    }
+        return dudu;
+    });
 }
 
 template < class Vec >
@@ -2174,28 +2251,27 @@ void createStiffnessMatrixMult_(const Mesh & mesh, Index order,
         __M;
         log(Critical, "Number of coefficients need to be lower then 4");
     }
-    ElementMatrix < double > dua;
-    ElementMatrix < double > duadu;
-
-    //#bool elastic, bool sum, bool div,
-
-    for (auto &cell: mesh.cells()){
-        cell->gradUCache().grad(*cell, order,
-                                 elastic, false, false,
-                                 nCoeff, mesh.nodeCount(), dofOffset, kelvin);
-        if (a.size() == 1 && mesh.cellCount() != 1){
-            createStiffnessMatrixPerCell_(mesh, order, ret, a[0],
-                                          nCoeff, dofOffset, elastic, kelvin);
-        } else if (a.size() == mesh.cellCount()){
-            mult(cell->gradUCache(), a[cell->id()], dua);
-            dot(dua, cell->gradUCache(), 1.0, duadu);
-            ret.add(duadu);
-        } else {
-            __M;
-            log(Critical, "Number of cell coefficients (",a.size(),") does not"
-                "match cell count:",  mesh.cellCount());
-        }
+    if (a.size() == 1 && mesh.cellCount() != 1){
+        //** one value for all cells
+        createStiffnessMatrixPerCell_(mesh, order, ret, a[0],
+                                      nCoeff, dofOffset, elastic, kelvin);
+        return;
     }
+    checkCellCoefficients_(mesh, a);
+
+    assembleCellsMap_(mesh, ret, [&](Cell & cell,
+                                     ElementMatrix < double > & duadu,
+                                     ElementMatrix < double > & dua)
+                                     -> const ElementMatrix < double > & {
+        //#bool elastic, bool sum, bool div,
+        cell.gradUCache().grad(cell, order,
+                               elastic, false, false,
+                               nCoeff, mesh.nodeCount(), dofOffset, kelvin);
+
+        mult(cell.gradUCache(), a[cell.id()], dua);
+        dot(dua, cell.gradUCache(), 1.0, duadu);
+        return duadu;
+    });
 }
 
 //** IMPL constants
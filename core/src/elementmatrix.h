@@ -519,6 +519,9 @@ DLLEXPORT void evaluateQuadraturePoints(const Mesh & mesh, Index order,
                                         const FEAFunction & f,
                               std::vector< std::vector< RMatrix > > & ret);
 
+/*! Create the shape functions of all cell and boundary types of the mesh
+ * in the ShapeFunctionCache, so threads can use the cache read only. */
+DLLEXPORT void fillShapeFunctionCache(const Mesh & mesh);
 
 #define DEFINE_CREATE_FORCE_VECTOR(A_TYPE) \
 DLLEXPORT void createForceVector(const Mesh & mesh, Index order, \
@@ -309,10 +309,13 @@ class SolverWrapper;
 typedef Pos RVector3;
 typedef std::complex < double > Complex;
 
-template < class ValueType >        class SparseMatrix;
+template < class ValueType, class IndexType = int > class SparseMatrix;
 typedef SparseMatrix< int >         ISparseMatrix;
 typedef SparseMatrix< double >      RSparseMatrix;
 typedef SparseMatrix< Complex >     CSparseMatrix;
+//! CRS matrices with 64 bit indices for more than 2^31 nonzeros.
+typedef SparseMatrix< double, SIndex >  RSparseMatrix64;
+typedef SparseMatrix< Complex, SIndex > CSparseMatrix64;
 
 template< class ValueType, class IndexType > class SparseMapMatrix;
 typedef SparseMapMatrix< int, Index >     ISparseMapMatrix;
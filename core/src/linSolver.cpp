@@ -115,6 +115,14 @@ void LinSolver::setMatrix(CSparseMatrix & S, int stype){
     initialize_(S, stype);
 }
 
+void LinSolver::setMatrix(RSparseMatrix64 & S, int stype){
+    initialize64_(S, stype);
+}
+
+void LinSolver::setMatrix(CSparseMatrix64 & S, int stype){
+    initialize64_(S, stype);
+}
+
 void LinSolver::solve(const RVector & rhs, RVector & solution){
     ASSERT_VEC_SIZE(rhs, cols_)
     solution.resize(rows_);
@@ -177,6 +185,18 @@ void LinSolver::initialize_(CSparseMatrix & S, int stype){
     }
 }
 
+template < class Mat > void LinSolver::initialize64_(Mat & S, int stype){
+    if (!CHOLMODWrapper::valid()){
+        throwError(WHERE_AM_I + " matrices with 64 bit indices need CHOLMOD.");
+    }
+    rows_ = S.rows();
+    cols_ = S.cols();
+    if (solver_) delete solver_;
+    solver_ = new CHOLMODWrapper(S, verbose_, stype);
+    // a following 32 bit matrix gets a new solver
+    solverTypeUsed_ = UNKNOWN;
+}
+
 std::string LinSolver::solverName() const {
     if (solver_) return solver_->name();
     __MS("no solver initialized")
@@ -66,6 +66,12 @@ public:
     /*! Verbose level = -1, use Linsolver.verbose(). */
     void setMatrix(CSparseMatrix & S, int stype=-2);
 
+    /*! Matrices with 64 bit indices are always factorized by CHOLMOD with
+     * its long interface, regardless of the solver type. Throws if CHOLMOD
+     * is not available. */
+    void setMatrix(RSparseMatrix64 & S, int stype=-2);
+    void setMatrix(CSparseMatrix64 & S, int stype=-2);
+
     SolverType solverType() const { return solverType_; }
 
     std::string solverName() const;
@@ -77,6 +83,7 @@ protected:
 
     void initialize_(RSparseMatrix & S, int stype);
     void initialize_(CSparseMatrix & S, int stype);
+    template < class Mat > void initialize64_(Mat & S, int stype);
 
     MatrixBase * cacheMatrix_;
     SolverType      solverType_;
@@ -923,6 +923,8 @@ void RegionManager::fillConstraints(RSparseMapMatrix & C){
 
     this->_cWeights.resize(nConstr, 1.0);
     C.clear();
+    //** collect all entries as triplets and merge them at once
+    C.setBuildMode(true);
 
     //!** no regions: fill 0th-order constraints
     if (regionMap_.empty() || nConstr == 0){
@@ -932,6 +934,7 @@ void RegionManager::fillConstraints(RSparseMapMatrix & C){
         for (Index i = 0; i < parameterCount(); i++) {
             C[i][i] = 1.0;
         }
+        C.setBuildMode(false);
         return;
     }
 
@@ -1037,6 +1040,7 @@ void RegionManager::fillConstraints(RSparseMapMatrix & C){
             }
         } // for each inter region combination with weight > 0
     } // if have inter regions
+    C.setBuildMode(false);
 }
 
 std::vector < RVector3 > RegionManager::boundaryNorm() const {
@@ -25,6 +25,8 @@
 
 #include "inversion.h"
 
+#include <atomic>
+
 #if USE_BOOST_THREAD
         boost::mutex ShapeFunctionWriteCacheMutex__;
 #else
@@ -92,6 +94,10 @@ std::ostream & operator << (std::ostream & str, const Shape & c){
     return str;
 }
 
+// the workspace matrices are per thread, so shapes can be used concurrently
+static thread_local std::vector< RMatrix3 > _rMatrix3Cache;
+static thread_local std::map< uint, std::vector< RMatrix > > _rMatrixCache;
+
 std::vector< RMatrix3 > & ShapeFunctionCache::RMatrix3Cache() {
     return _rMatrix3Cache;
 }
@@ -99,6 +105,48 @@ std::vector< RMatrix > & ShapeFunctionCache::RMatrixCache(uint rtti) {
     return _rMatrixCache[rtti];
 }
 
+// entries of the shared cache already looked up by this thread, invalid
+// if the generation of the cache changed by clear
+static std::atomic< Index > _shapeFunctionGeneration(1);
+static thread_local Index _threadShapeFunctionGeneration = 0;
+static thread_local std::map< uint8, const ShapeFunctionCache::Entry * > _threadShapeFunctions;
+
+#if USE_BOOST_THREAD
+    typedef boost::mutex::scoped_lock ShapeFunctionLock_;
+#else
+    typedef std::unique_lock< std::mutex > ShapeFunctionLock_;
+#endif
+
+const ShapeFunctionCache::Entry * ShapeFunctionCache::find_(uint8 rtti) const {
+    Index generation = _shapeFunctionGeneration.load();
+    if (_threadShapeFunctionGeneration != generation){
+        _threadShapeFunctions.clear();
+        _threadShapeFunctionGeneration = generation;
+    }
+    auto it = _threadShapeFunctions.find(rtti);
+    if (it != _threadShapeFunctions.end()) return it->second;
+
+    ShapeFunctionLock_ lock(ShapeFunctionWriteCacheMutex__);
+    auto e = entries_.find(rtti);
+    if (e == entries_.end()) return 0;
+    _threadShapeFunctions[rtti] = &e->second;
+    return &e->second;
+}
+
+const ShapeFunctionCache::Entry * ShapeFunctionCache::insert_(uint8 rtti,
+                                                              const Entry & entry) const {
+    ShapeFunctionLock_ lock(ShapeFunctionWriteCacheMutex__);
+    const Entry * ret = &entries_.insert(std::make_pair(rtti, entry)).first->second;
+    _threadShapeFunctions[rtti] = ret;
+    return ret;
+}
+
+void ShapeFunctionCache::clear() {
+    ShapeFunctionLock_ lock(ShapeFunctionWriteCacheMutex__);
+    entries_.clear();
+    _shapeFunctionGeneration ++;
+}
+
 RMatrix3 & ShapeFunctionCache::cachedRMatrix3(uint i) {
     ASSERT_SIZE(_rMatrix3Cache, i)
     return _rMatrix3Cache[i];
@@ -78,35 +78,25 @@ class DLLEXPORT ShapeFunctionCache : public Singleton< ShapeFunctionCache > {
 public:
     friend class Singleton< ShapeFunctionCache >;
 
+    /*! Shape functions of one entity type and their derivatives. */
+    struct Entry {
+        std::vector < PolynomialFunction < double > > N;
+        std::vector < std::vector < PolynomialFunction < double > > > dN;
+    };
+
     template < class Ent > const std::vector < PolynomialFunction < double > > &
     shapeFunctions(const Ent & e) const {
-
-        std::map < uint8, std::vector < PolynomialFunction < double > > >::const_iterator it = shapeFunctions_.find(e.rtti());
-
-        if (it == shapeFunctions_.end()){
-            this->createShapeFunctions_(e);
-            it = shapeFunctions_.find(e.rtti());
-        }
-
-        return (*it).second;
+        return entry_(e).N;
     }
 
     template < class Ent > const std::vector < PolynomialFunction < double > > &
     deriveShapeFunctions(const Ent & e , uint dim) const {
-        std::map < uint8, std::vector < std::vector < PolynomialFunction < double > > > >::const_iterator it = dShapeFunctions_.find(e.rtti());
-
-        if (it == dShapeFunctions_.end()) {
-            this->createShapeFunctions_(e);
-            it = dShapeFunctions_.find(e.rtti());
-        }
-        return (*it).second[dim];
+        return entry_(e).dN[dim];
     }
 
-    /*! Clear the cache. */
-    void clear() {
-        shapeFunctions_.clear();
-        dShapeFunctions_.clear();
-    }
+    /*! Clear the cache. Not thread safe, no other thread may use the
+     * cache meanwhile. */
+    void clear();
 
     std::vector< RMatrix3 > & RMatrix3Cache();
     std::vector< RMatrix > & RMatrixCache(uint rtti);
@@ -115,41 +105,29 @@ public:
     RMatrix & cachedRMatrix(uint rtti, uint i);
 private:
 
-    /*! probably threading problems .. pls check*/
-    template < class Ent > void createShapeFunctions_(const Ent & e) const {
-        std::vector < PolynomialFunction < double > > N = e.createShapeFunctions();
-
-        #if USE_BOOST_THREAD
-        //#ifdef WIN32_LEAN_AND_MEAN
-        //        __MS("pls check missing mutex")
-            //boost::mutex::scoped_lock lock(ShapeFunctionWriteCacheMutex__);
-        //#else
-            #ifndef PYGIMLI_CAST // fails because of boost threads and clang problems
-            boost::mutex::scoped_lock lock(ShapeFunctionWriteCacheMutex__);
-            #endif
-        //#endif
-
-        #else
-        // __MS("lock deactiated " << ShapeFunctionWriteCacheMutex__)
-
-            std::unique_lock < std::mutex > lock(ShapeFunctionWriteCacheMutex__);
-        #endif
-
-
-        shapeFunctions_[e.rtti()] = N;
-        dShapeFunctions_[e.rtti()] = std::vector < std::vector < PolynomialFunction < double > > >();
-
-        dShapeFunctions_[e.rtti()].push_back(std::vector < PolynomialFunction < double > >());
-        dShapeFunctions_[e.rtti()].push_back(std::vector < PolynomialFunction < double > >());
-        dShapeFunctions_[e.rtti()].push_back(std::vector < PolynomialFunction < double > >());
-
-        for (uint i = 0; i < N.size(); i ++){
-            dShapeFunctions_[e.rtti()][0].push_back(N[i].derive(0));
-            dShapeFunctions_[e.rtti()][1].push_back(N[i].derive(1));
-            dShapeFunctions_[e.rtti()][2].push_back(N[i].derive(2));
+    /*! The entry for the type of e, created on the first use. */
+    template < class Ent > const Entry & entry_(const Ent & e) const {
+        const Entry * entry = find_(e.rtti());
+        if (entry) return *entry;
+
+        Entry newEntry;
+        newEntry.N = e.createShapeFunctions();
+        newEntry.dN.resize(3);
+        for (uint i = 0; i < newEntry.N.size(); i ++){
+            newEntry.dN[0].push_back(newEntry.N[i].derive(0));
+            newEntry.dN[1].push_back(newEntry.N[i].derive(1));
+            newEntry.dN[2].push_back(newEntry.N[i].derive(2));
         }
+        return *insert_(e.rtti(), newEntry);
     }
 
+    /*! Return the entry of rtti or 0. Each thread keeps its own index of
+     * the entries, so only its first lookup of a type locks the cache. */
+    const Entry * find_(uint8 rtti) const;
+
+    /*! Publish a completely built entry, the one of a faster thread wins. */
+    const Entry * insert_(uint8 rtti, const Entry & entry) const;
+
     /*! Private so that it can not be called */
     ShapeFunctionCache(){}
     /*! Private so that it can not be called */
@@ -161,14 +139,9 @@ private:
 
 protected:
 
-    /*! Cache for shape functions. */
-    mutable std::map < uint8, std::vector < PolynomialFunction < double > > > shapeFunctions_;
-
-    /*! Cache for shape functions derivatives. */
-    mutable std::map < uint8, std::vector< std::vector < PolynomialFunction < double > > > > dShapeFunctions_;
-
-    mutable std::vector< RMatrix3 > _rMatrix3Cache;
-    mutable std::map< uint, std::vector< RMatrix > > _rMatrixCache;
+    /*! Cache for shape functions and their derivatives, entries are never
+     * moved or removed until clear. */
+    mutable std::map < uint8, Entry > entries_;
 
 };
 
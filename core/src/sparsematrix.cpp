@@ -21,82 +21,295 @@
 
 namespace GIMLI{
 
-template<>
-void SparseMatrix< double >::copy_(const SparseMapMatrix< double, Index > & S){
-    this->clear();
-    Index col = 0, row = 0;
-    double val;
-    cols_ = S.cols();
-    rows_ = S.rows();
-    std::vector < std::map < Index, double > > rowColMap(S.rows());
-
-    for (typename SparseMapMatrix< double, Index>::const_iterator
-        it = S.begin(); it != S.end(); it ++){
-        row = S.idx1(it);
-        col = S.idx2(it);
-        val = S.val(it);
-        rowColMap[row].insert(std::pair< Index, double >(col, val));
+Index meshPatternHash(const Mesh & mesh){
+    Index seed = 0;
+    for (Index i = 0; i < mesh.nodeCount(); i ++){
+        hashCombine(seed, mesh.node(i).pos());
+    }
+    for (Index i = 0; i < mesh.cellCount(); i ++){
+        const Cell & c = mesh.cell(i);
+        hashCombine(seed, c.nodeCount());
+        for (Index j = 0; j < c.nodeCount(); j ++) hashCombine(seed, c.node(j).id());
     }
-    colPtr_.resize(S.rows() + 1);
-    rowIdx_.resize(S.nVals());
-    vals_.resize(S.nVals());
-    stype_  = S.stype();
-
-    this->colPtr_[0] = 0;
-
-    Index colPtr = 0;
-    row = 0;
-    for (typename std::vector < std::map < Index, double > >::iterator
-         it = rowColMap.begin(); it != rowColMap.end(); it++){
-        for (typename std::map < Index, double >::iterator
-             itR = (*it).begin(); itR != (*it).end(); itR++){
-            rowIdx_[colPtr] = itR->first;
-            vals_[colPtr] = (double)itR->second;
-            colPtr ++;
+    for (Index i = 0; i < mesh.boundaryCount(); i ++){
+        const Boundary & b = mesh.boundary(i);
+        hashCombine(seed, b.nodeCount());
+        for (Index j = 0; j < b.nodeCount(); j ++) hashCombine(seed, b.node(j).id());
+    }
+    return seed;
+}
+
+template <> DLLEXPORT SparsityPatternCache * Singleton < SparsityPatternCache >::pInstance_ = NULL;
+
+//! Minimum number of cell nodes to build the sparsity pattern threaded.
+static const Index SPARSITY_PATTERN_MT_MIN = 10000;
+
+template < class IndexType >
+class MeshSparsityPatternMT : public BaseCalcMT {
+public:
+    MeshSparsityPatternMT(const std::vector< Index > & nodeCellPtr,
+                          const std::vector< Index > & nodeCells,
+                          const std::vector< Index > & cellNodePtr,
+                          const std::vector< int > & cellNodes,
+                          IndexType * rowPtr, IndexType * colIdx)
+    : BaseCalcMT(false), nodeCellPtr_(&nodeCellPtr), nodeCells_(&nodeCells),
+      cellNodePtr_(&cellNodePtr), cellNodes_(&cellNodes),
+      rowPtr_(rowPtr), colIdx_(colIdx) { }
+
+    virtual ~MeshSparsityPatternMT(){}
+
+    /*! Count the row sizes into rowPtr[i + 1] if colIdx is 0, otherwise
+     * fill the rows starting at rowPtr[i]. */
+    virtual void calc(){
+        const std::vector< Index > & nodeCellPtr = *nodeCellPtr_;
+        const std::vector< Index > & nodeCells = *nodeCells_;
+        const std::vector< Index > & cellNodePtr = *cellNodePtr_;
+        const std::vector< int > & cellNodes = *cellNodes_;
+
+        std::vector< int > row;
+        for (Index i = start_; i < end_; i ++){
+            row.clear();
+            for (Index k = nodeCellPtr[i]; k < nodeCellPtr[i + 1]; k ++){
+                Index c = nodeCells[k];
+                row.insert(row.end(), cellNodes.begin() + cellNodePtr[c],
+                                      cellNodes.begin() + cellNodePtr[c + 1]);
+            }
+            std::sort(row.begin(), row.end());
+            row.erase(std::unique(row.begin(), row.end()), row.end());
+
+            if (colIdx_){
+                std::copy(row.begin(), row.end(), colIdx_ + rowPtr_[i]);
+            } else {
+                rowPtr_[i + 1] = row.size();
+            }
+        }
+    }
+
+protected:
+    const std::vector< Index > * nodeCellPtr_;
+    const std::vector< Index > * nodeCells_;
+    const std::vector< Index > * cellNodePtr_;
+    const std::vector< int > * cellNodes_;
+    IndexType * rowPtr_;
+    IndexType * colIdx_;
+};
+
+/*! Node ids of all cells and cell indices of all nodes in CRS form. */
+static void nodeCellAdjacency_(const Mesh & mesh,
+                               std::vector< Index > & cellNodePtr,
+                               std::vector< int > & cellNodes,
+                               std::vector< Index > & nodeCellPtr,
+                               std::vector< Index > & nodeCells){
+    Index nNodes = mesh.nodeCount();
+    Index nCells = mesh.cellCount();
+
+    // node ids of all cells
+    cellNodePtr.assign(nCells + 1, 0);
+    for (Index c = 0; c < nCells; c ++){
+        cellNodePtr[c + 1] = cellNodePtr[c] + mesh.cell(c).nodeCount();
+    }
+    cellNodes.resize(cellNodePtr[nCells]);
+
+    // cells for all nodes
+    nodeCellPtr.assign(nNodes + 1, 0);
+    for (Index c = 0; c < nCells; c ++){
+        const Cell & cell = mesh.cell(c);
+        for (Index i = 0; i < cell.nodeCount(); i ++){
+            cellNodes[cellNodePtr[c] + i] = cell.node(i).id();
+            nodeCellPtr[cell.node(i).id() + 1] ++;
+        }
+    }
+    for (Index i = 0; i < nNodes; i ++) nodeCellPtr[i + 1] += nodeCellPtr[i];
+
+    nodeCells.resize(nodeCellPtr[nNodes]);
+    std::vector< Index > pos(nodeCellPtr.begin(), nodeCellPtr.end() - 1);
+    for (Index c = 0; c < nCells; c ++){
+        for (Index k = cellNodePtr[c]; k < cellNodePtr[c + 1]; k ++){
+            nodeCells[pos[cellNodes[k]] ++] = c;
         }
-        row ++;
-        this->colPtr_[row] = colPtr;
     }
-    valid_ = true;
 }
 
-template<>
-void SparseMatrix< Complex >::copy_(const SparseMapMatrix< Complex, Index > & S){
-    this->clear();
-    Index col = 0, row = 0;
-    Complex val;
-    cols_ = S.cols();
-    rows_ = S.rows();
-    std::vector < std::map < Index, Complex > > rowColMap(S.rows());
-
-    for (typename SparseMapMatrix< Complex, Index>::const_iterator
-        it = S.begin(); it != S.end(); it ++){
-        row = S.idx1(it);
-        col = S.idx2(it);
-        val = S.val(it);
-        rowColMap[row].insert(std::pair< Index, Complex >(col, val));
+template < class IndexType >
+static void buildMeshSparsityPattern_(const Mesh & mesh,
+                                      std::vector< IndexType > & rowPtr,
+                                      std::vector< IndexType > & colIdx){
+    Index nNodes = mesh.nodeCount();
+    checkIndexRange< IndexType >(nNodes, WHERE_AM_I);
+
+    std::vector< Index > cellNodePtr;
+    std::vector< int > cellNodes;
+    std::vector< Index > nodeCellPtr;
+    std::vector< Index > nodeCells;
+    nodeCellAdjacency_(mesh, cellNodePtr, cellNodes, nodeCellPtr, nodeCells);
+
+    Index nThreads = threadCount();
+    if (cellNodes.size() < SPARSITY_PATTERN_MT_MIN) nThreads = 1;
+    nThreads = max(Index(1), min(nThreads, nNodes));
+
+    rowPtr.assign(nNodes + 1, 0);
+    colIdx.clear();
+
+    // first pass: count the row sizes, second pass: fill the rows
+    for (Index pass = 0; pass < 2; pass ++){
+        if (pass == 1){
+            Index nVals = 0;
+            for (Index i = 0; i < nNodes; i ++) {
+                nVals += rowPtr[i + 1];
+                checkIndexRange< IndexType >(nVals, WHERE_AM_I);
+                rowPtr[i + 1] = nVals;
+            }
+            colIdx.resize(nVals);
+            if (colIdx.empty()) break;
+        }
+        MeshSparsityPatternMT< IndexType > calc(nodeCellPtr, nodeCells,
+                                                cellNodePtr, cellNodes, &rowPtr[0],
+                                                pass == 0 ? 0 : &colIdx[0]);
+        if (nThreads < 2){
+            calc.setRange(0, nNodes);
+            calc.calc();
+        } else {
+            distributeCalc(calc, nNodes, nThreads);
+        }
     }
-    colPtr_.resize(S.rows() + 1);
-    rowIdx_.resize(S.nVals());
-    vals_.resize(S.nVals());
-    stype_  = S.stype();
-
-    this->colPtr_[0] = 0;
-
-    Index colPtr = 0;
-    row = 0;
-    for (typename std::vector < std::map < Index, Complex > >::iterator
-         it = rowColMap.begin(); it != rowColMap.end(); it++){
-        for (typename std::map < Index, Complex >::iterator
-             itR = (*it).begin(); itR != (*it).end(); itR++){
-            rowIdx_[colPtr] = itR->first;
-            vals_[colPtr] = (Complex)itR->second;
-            colPtr ++;
+}
+
+void buildMeshSparsityPattern(const Mesh & mesh,
+                              std::vector< int > & rowPtr,
+                              std::vector< int > & colIdx){
+    buildMeshSparsityPattern_(mesh, rowPtr, colIdx);
+}
+
+void buildMeshSparsityPattern(const Mesh & mesh,
+                              std::vector< SIndex > & rowPtr,
+                              std::vector< SIndex > & colIdx){
+    buildMeshSparsityPattern_(mesh, rowPtr, colIdx);
+}
+
+void colorMeshCells(const Mesh & mesh, std::vector< IndexArray > & colors){
+    Index nCells = mesh.cellCount();
+
+    std::vector< Index > cellNodePtr;
+    std::vector< int > cellNodes;
+    std::vector< Index > nodeCellPtr;
+    std::vector< Index > nodeCells;
+    nodeCellAdjacency_(mesh, cellNodePtr, cellNodes, nodeCellPtr, nodeCells);
+
+    // first free color not used by any colored neighbour cell
+    std::vector< Index > color(nCells, 0);
+    std::vector< Index > usedBy;
+    colors.clear();
+
+    for (Index c = 0; c < nCells; c ++){
+        for (Index k = cellNodePtr[c]; k < cellNodePtr[c + 1]; k ++){
+            Index n = cellNodes[k];
+            for (Index l = nodeCellPtr[n]; l < nodeCellPtr[n + 1]; l ++){
+                Index d = nodeCells[l];
+                if (d < c) usedBy[color[d]] = c + 1;
+            }
+        }
+        Index col = 0;
+        while (col < usedBy.size() && usedBy[col] == c + 1) col ++;
+        if (col == usedBy.size()){
+            usedBy.push_back(0);
+            colors.push_back(IndexArray(0));
+        }
+        color[c] = col;
+        colors[col].push_back(c);
+    }
+}
+
+bool SparsityPatternCache::match_(const Mesh & mesh, Index hash) const {
+    return hash_ == hash && nNodes_ == mesh.nodeCount() &&
+           nCells_ == mesh.cellCount() && nBounds_ == mesh.boundaryCount();
+}
+
+void SparsityPatternCache::reset_(const Mesh & mesh, Index hash){
+    if (match_(mesh, hash)) return;
+    hash_ = hash;
+    nNodes_ = mesh.nodeCount();
+    nCells_ = mesh.cellCount();
+    nBounds_ = mesh.boundaryCount();
+    hasPattern_ = false;
+    hasColors_ = false;
+    std::vector< int >().swap(rowPtr_);
+    std::vector< int >().swap(colIdx_);
+    map_.reset();
+    colors_.clear();
+}
+
+bool SparsityPatternCache::get(const Mesh & mesh, Index hash,
+                               std::vector< int > & rowPtr,
+                               std::vector< int > & colIdx,
+                               std::shared_ptr< const ElementScatterMap< int > > * map) const {
+    std::lock_guard< std::mutex > lock(mutex_);
+    if (!hasPattern_ || !match_(mesh, hash)) {
+        if (map) map->reset();
+        return false;
+    }
+    rowPtr = rowPtr_;
+    colIdx = colIdx_;
+    if (map) *map = map_.lock();
+    return true;
+}
+
+void SparsityPatternCache::set(const Mesh & mesh, Index hash,
+                               const std::vector< int > & rowPtr,
+                               const std::vector< int > & colIdx,
+                               const std::shared_ptr< const ElementScatterMap< int > > * map){
+    std::lock_guard< std::mutex > lock(mutex_);
+    reset_(mesh, hash);
+    if (!hasPattern_){
+        rowPtr_ = rowPtr;
+        colIdx_ = colIdx;
+        hasPattern_ = true;
+    }
+    if (map) map_ = *map;
+}
+
+void SparsityPatternCache::cellColors(const Mesh & mesh, Index hash,
+                                      std::vector< IndexArray > & colors){
+    {
+        std::lock_guard< std::mutex > lock(mutex_);
+        if (hasColors_ && match_(mesh, hash)){
+            colors = colors_;
+            return;
         }
-        row ++;
-        this->colPtr_[row] = colPtr;
     }
-    valid_ = true;
+    colorMeshCells(mesh, colors);
+
+    std::lock_guard< std::mutex > lock(mutex_);
+    reset_(mesh, hash);
+    colors_ = colors;
+    hasColors_ = true;
+}
+
+void SparsityPatternCache::clear(){
+    std::lock_guard< std::mutex > lock(mutex_);
+    std::vector< int >().swap(rowPtr_);
+    std::vector< int >().swap(colIdx_);
+    map_.reset();
+    colors_.clear();
+    hasPattern_ = false;
+    hasColors_ = false;
+    hash_ = 0;
+}
+
+template<>
+void SparseMatrix< double >::copy_(const SparseMapMatrix< double, Index > & S){
+    copyCRS_(S);
+}
+template<>
+void SparseMatrix< Complex >::copy_(const SparseMapMatrix< Complex, Index > & S){
+    copyCRS_(S);
+}
+template<>
+void SparseMatrix< double, SIndex >::copy_(const SparseMapMatrix< double, Index > & S){
+    copyCRS_(S);
+}
+template<>
+void SparseMatrix< Complex, SIndex >::copy_(const SparseMapMatrix< Complex, Index > & S){
+    copyCRS_(S);
 }
 
 template<>
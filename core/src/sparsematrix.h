@@ -28,6 +28,7 @@
 #include "meshentities.h"
 #include "node.h"
 #include "stopwatch.h"
+#include "calculateMultiThread.h"
 
 #include <map>
 #include <set>
@@ -36,6 +37,9 @@
 #include <cassert>
 #include <iostream>
 #include <cmath>
+#include <mutex>
+#include <memory>
+#include <limits>
 
 namespace GIMLI{
 
@@ -48,7 +52,15 @@ public:
   typedef MatrixElement< ValueType, IndexType, ContainerType > & Reference;
 
   MatrixElement(ContainerType & Cont, IndexType r, IndexType c)
-    : C(Cont), I(C.find(IndexPair(r, c))), row(r), column(c) {
+    : C(Cont), I(C.find(IndexPair(r, c))), row(r), column(c), M(0) {
+  }
+
+  /* Element of a SparseMapMatrix. The container is not touched here,
+     every write is passed to the matrix, see SparseMapMatrix::write_,
+     and reading the value finalizes the matrix first. */
+  MatrixElement(SparseMapMatrix< ValueType, IndexType > & Mat,
+                ContainerType & Cont, IndexType r, IndexType c)
+    : C(Cont), I(Cont.end()), row(r), column(c), M(&Mat) {
   }
 
   /* An assignment operator is required which in turn requires a
@@ -73,6 +85,7 @@ public:
      C.end(). */
 
   ValueType asValue() const {
+    if (M) return M->getVal(row, column);
     if (I == C.end()) return ValueType(0); else return (*I).second;
   }
 
@@ -85,6 +98,10 @@ public:
      stored in the container. */
 
   Reference operator = (const ValueType & x) {
+    if (M) {
+        M->write_(row, column, x, true);
+        return *this;
+    }
     // not equal 0?
     if (x != ValueType(0) || 1) { // we need the element to force some sought  matrix shape
       /* If the element does not yet exist, it is put,  together
@@ -117,6 +134,10 @@ public:
   }
 
   Reference operator += (const ValueType & x) {
+    if (M) {
+        M->write_(row, column, x, false);
+        return *this;
+    }
     if (x != ValueType(0) || 1 ) { // we need the element to force some sought  matrix shape
       if (I == C.end()) {
         assert(C.size() < C.max_size());
@@ -127,6 +148,10 @@ public:
   }
 
   Reference operator -= (const ValueType & x) {
+    if (M) {
+        M->write_(row, column, -x, false);
+        return *this;
+    }
     if (x != ValueType(0) || 1) {
       if (I == C.end()) {
         assert(C.size() < C.max_size());
@@ -140,11 +165,388 @@ private:
   ContainerType & C;
   typename ContainerType::iterator I;
   IndexType row, column;
+  SparseMapMatrix< ValueType, IndexType > * M;
 
 };  // class MatrixElement
 
 
+//! Minimum number of matrix values to start threaded matrix-vector products.
+static const Index SPARSE_MULT_MT_MIN_VALS = 100000;
+
+//! Minimum number of mesh cells to start threaded matrix assembling.
+static const Index SPARSE_ASSEMBLY_MT_MIN_CELLS = 10000;
+
+/*! Throw if n does not fit into the CRS IndexType. 32 bit CRS matrices
+ * hold at most 2^31 - 1 values. The index type is not switched
+ * automatically, larger systems need to be assembled into RSparseMatrix64
+ * or CSparseMatrix64 and solved with CHOLMOD, see LinSolver::setMatrix. */
+template < class IndexType >
+void checkIndexRange(Index n, const std::string & where){
+    if (n > Index(std::numeric_limits< IndexType >::max())){
+        throwError(where + " " + str(n) + " exceeds the range of the "
+                   + str(sizeof(IndexType) * 8) + " bit sparse matrix index. "
+                   "Use RSparseMatrix64 or CSparseMatrix64.");
+    }
+}
+
+//! Transposed sparsity pattern of a compressed row storage (CRS) matrix.
+/*! For each column the row indices and the positions of the values in
+ * the CRS value array, both in ascending row order. This allows conflict
+ * free transposed products, row by row of the transpose. The pattern does
+ * not depend on the values. It is keyed on the address and size of the
+ * CRS arrays it was built from and the owning matrix invalidates it
+ * whenever it changes its sparsity pattern. Building is thread safe,
+ * copies start invalid. */
+template < class IndexType > class CRSTransposedPattern {
+public:
+    CRSTransposedPattern()
+        : valid_(false), nRows_(0), nVals_(0), rowPtr_(0), colIdx_(0) { }
+
+    CRSTransposedPattern(const CRSTransposedPattern & T)
+        : valid_(false), nRows_(0), nVals_(0), rowPtr_(0), colIdx_(0) { }
+
+    CRSTransposedPattern & operator = (const CRSTransposedPattern & T){
+        this->invalidate();
+        return *this;
+    }
+
+    inline void invalidate(){ valid_ = false; }
+
+    /*! Build the pattern if necessary. */
+    void update(Index nRows, Index nCols,
+                const IndexType * rowPtr, const IndexType * colIdx){
+        std::lock_guard< std::mutex > lock(mutex_);
+        Index nVals = rowPtr[nRows];
+        if (valid_ && rowPtr_ == rowPtr && colIdx_ == colIdx &&
+            nRows_ == nRows && nVals_ == nVals &&
+            colPtr_.size() >= nCols + 1) return;
+
+        for (Index k = 0; k < nVals; k ++) nCols = max(nCols, Index(colIdx[k] + 1));
+
+        colPtr_.assign(nCols + 1, 0);
+        rowIdx_.resize(nVals);
+        valIdx_.resize(nVals);
+
+        for (Index k = 0; k < nVals; k ++) colPtr_[colIdx[k] + 1] ++;
+        for (Index j = 0; j < nCols; j ++) colPtr_[j + 1] += colPtr_[j];
+
+        std::vector< Index > pos(colPtr_.begin(), colPtr_.end() - 1);
+        for (Index i = 0; i < nRows; i ++){
+            for (IndexType k = rowPtr[i]; k < rowPtr[i + 1]; k ++){
+                Index p = pos[colIdx[k]] ++;
+                rowIdx_[p] = i;
+                valIdx_[p] = k;
+            }
+        }
+        nRows_ = nRows;
+        nVals_ = nVals;
+        rowPtr_ = rowPtr;
+        colIdx_ = colIdx;
+        valid_ = true;
+    }
+
+    inline const Index * colPtr() const { return &colPtr_[0]; }
+    inline const Index * rowIdx() const { return rowIdx_.empty() ? 0 : &rowIdx_[0]; }
+    inline const Index * valIdx() const { return valIdx_.empty() ? 0 : &valIdx_[0]; }
+    inline Index nCols() const { return colPtr_.size() - 1; }
+
+protected:
+    std::mutex mutex_;
+    bool valid_;
+    Index nRows_;
+    Index nVals_;
+    const IndexType * rowPtr_;
+    const IndexType * colIdx_;
+    std::vector< Index > colPtr_;
+    std::vector< Index > rowIdx_;
+    std::vector< Index > valIdx_;
+};
+
+/*! Hash of the node positions and the node ids of all cells and
+ * boundaries, i.e., of everything a mesh sparsity pattern and its scatter
+ * map depend on. Unlike Mesh::hash it ignores markers and mesh data. */
+DLLEXPORT Index meshPatternHash(const Mesh & mesh);
+
+//! Value positions of mesh entities in a CRS sparsity pattern.
+/*! For every cell and boundary of a mesh the positions of its local
+ * (nNodes x nNodes) matrix entries in the value array of a CRS pattern,
+ * row by row in the node order of the entity. Entities with entries
+ * outside the pattern get an empty range.
+ * The map is bound to the mesh it was built for, see \ref valid. */
+template < class IndexType > class ElementScatterMap {
+public:
+    ElementScatterMap() : nNodes_(0), hash_(0) { }
+
+    void clear(){
+        cellPtr_.clear();
+        cellIdx_.clear();
+        boundPtr_.clear();
+        boundIdx_.clear();
+        nNodes_ = 0;
+        hash_ = 0;
+    }
+
+    /*! Return true if the map was built for this mesh. */
+    bool valid(const Mesh & mesh) const {
+        return valid(mesh, meshPatternHash(mesh));
+    }
+
+    /*! Return true if the map was built for this mesh with known
+     * \ref meshPatternHash. */
+    bool valid(const Mesh & mesh, Index hash) const {
+        return cellPtr_.size() == mesh.cellCount() + 1 &&
+               boundPtr_.size() == mesh.boundaryCount() + 1 &&
+               nNodes_ == mesh.nodeCount() && hash_ == hash;
+    }
+
+    /*! Build the map for all cells and boundaries of the mesh. */
+    void build(const Mesh & mesh, Index nRows,
+               const IndexType * rowPtr, const IndexType * colIdx){
+        build(mesh, meshPatternHash(mesh), nRows, rowPtr, colIdx);
+    }
+
+    /*! Build the map for all cells and boundaries of the mesh with known
+     * \ref meshPatternHash. */
+    void build(const Mesh & mesh, Index hash, Index nRows,
+               const IndexType * rowPtr, const IndexType * colIdx){
+        fill_(mesh.cells(), nRows, rowPtr, colIdx, cellPtr_, cellIdx_);
+        fill_(mesh.boundaries(), nRows, rowPtr, colIdx, boundPtr_, boundIdx_);
+        nNodes_ = mesh.nodeCount();
+        hash_ = hash;
+    }
+
+    /*! Return the value positions for cell c with n nodes or 0 if there are none. */
+    inline const Index * cell(Index c, Index n) const {
+        return entity_(cellPtr_, cellIdx_, c, n);
+    }
+
+    /*! Return the value positions for boundary b with n nodes or 0 if there are none. */
+    inline const Index * boundary(Index b, Index n) const {
+        return entity_(boundPtr_, boundIdx_, b, n);
+    }
+
+protected:
+    template < class Ent >
+    void fill_(const std::vector< Ent * > & ents, Index nRows,
+               const IndexType * rowPtr, const IndexType * colIdx,
+               std::vector< Index > & ptr, std::vector< Index > & idx){
+        ptr.resize(ents.size() + 1);
+        ptr[0] = 0;
+        Index nVals = 0;
+        for (Index e = 0; e < ents.size(); e ++){
+            Index n = ents[e]->nodeCount();
+            nVals += n * n;
+        }
+        idx.resize(nVals);
+
+        Index k = 0;
+        for (Index e = 0; e < ents.size(); e ++){
+            const Ent & ent = *ents[e];
+            Index n = ent.nodeCount();
+            Index start = k;
+            bool complete = true;
+            for (Index i = 0; i < n && complete; i ++){
+                Index row = ent.node(i).id();
+                if (row >= nRows) { complete = false; break; }
+                for (Index j = 0; j < n; j ++){
+                    IndexType col = ent.node(j).id();
+                    // rows are usually sorted, else search linear
+                    const IndexType * first = colIdx + rowPtr[row];
+                    const IndexType * last = colIdx + rowPtr[row + 1];
+                    const IndexType * p = std::lower_bound(first, last, col);
+                    if (p == last || *p != col) p = std::find(first, last, col);
+                    if (p == last) { complete = false; break; }
+                    idx[k] = p - colIdx;
+                    k ++;
+                }
+            }
+            if (!complete) k = start;
+            ptr[e + 1] = k;
+        }
+        idx.resize(k);
+    }
+
+    inline const Index * entity_(const std::vector< Index > & ptr,
+                                 const std::vector< Index > & idx,
+                                 Index e, Index n) const {
+        if (e + 1 < ptr.size() && n > 0 && ptr[e + 1] - ptr[e] == n * n){
+            return &idx[ptr[e]];
+        }
+        return 0;
+    }
+
+    std::vector< Index > cellPtr_;
+    std::vector< Index > cellIdx_;
+    std::vector< Index > boundPtr_;
+    std::vector< Index > boundIdx_;
+    Index nNodes_;
+    Index hash_;
+};
+
+//! Matrix-vector product for compressed row storage (CRS) arrays.
+/*! Every output value ret[i] is written by one thread only. Products
+ * that need a scatter in row order (transposed and symmetric storage)
+ * gather along the transposed pattern instead. Each value is summed in a
+ * fixed order, so the threaded results do not depend on the number of
+ * threads. For symmetric storage this order differs from the serial
+ * scatter of \ref multCRS, so serial and threaded results may differ
+ * in rounding.
+ * stype: 0 = nonsymmetric, -1 symmetric lower part, 1 symmetric upper part. */
+template < class ValueType, class IndexType >
+class CRSMultMT : public BaseCalcMT {
+public:
+    CRSMultMT(ValueType * ret, const ValueType * a,
+              const IndexType * rowPtr, const IndexType * colIdx,
+              const ValueType * vals, const CRSTransposedPattern< IndexType > * T,
+              Index nRows, int stype, bool trans)
+    : BaseCalcMT(false), ret_(ret), a_(a), rowPtr_(rowPtr), colIdx_(colIdx),
+      vals_(vals), T_(T), nRows_(nRows), stype_(stype), trans_(trans) {
+    }
+
+    virtual ~CRSMultMT(){}
+
+    virtual void calc(){
+        for (Index i = start_; i < end_; i ++){
+            ValueType s(0);
+            if (stype_ == 0){
+                if (trans_) gatherT_(i, false, s);
+                else gatherRow_(i, false, s);
+            } else if (stype_ == -1){
+                if (trans_){
+                    gatherT_(i, true, s);
+                    gatherRowStrict_(i, false, s);
+                } else {
+                    gatherTStrict_(i, false, s);
+                    gatherRow_(i, true, s);
+                }
+            } else if (stype_ == 1){
+                if (trans_){
+                    gatherRowStrict_(i, true, s);
+                    gatherT_(i, true, s);
+                } else {
+                    gatherRow_(i, true, s);
+                    gatherTStrict_(i, true, s);
+                }
+            }
+            ret_[i] = s;
+        }
+    }
+
+protected:
+    /*! Add row i to s. */
+    inline void gatherRow_(Index i, bool conjugate, ValueType & s) const {
+        if (i >= nRows_) return;
+        for (IndexType k = rowPtr_[i]; k < rowPtr_[i + 1]; k ++){
+            if (conjugate) s += a_[colIdx_[k]] * conj(vals_[k]);
+            else s += a_[colIdx_[k]] * vals_[k];
+        }
+    }
+    /*! Add the part of row i with col < i (lower) or col > i to s. */
+    inline void gatherRowStrict_(Index i, bool lower, ValueType & s) const {
+        if (i >= nRows_) return;
+        for (IndexType k = rowPtr_[i]; k < rowPtr_[i + 1]; k ++){
+            Index j = colIdx_[k];
+            if ((lower && j < i) || (!lower && j > i)) s += a_[j] * vals_[k];
+        }
+    }
+    /*! Add column j to s. */
+    inline void gatherT_(Index j, bool conjugate, ValueType & s) const {
+        if (j >= T_->nCols()) return;
+        const Index * colPtr = T_->colPtr();
+        const Index * rowIdx = T_->rowIdx();
+        const Index * valIdx = T_->valIdx();
+        for (Index k = colPtr[j]; k < colPtr[j + 1]; k ++){
+            if (conjugate) s += a_[rowIdx[k]] * conj(vals_[valIdx[k]]);
+            else s += a_[rowIdx[k]] * vals_[valIdx[k]];
+        }
+    }
+    /*! Add the part of column j with row > j (lower) or row < j to s. */
+    inline void gatherTStrict_(Index j, bool lower, ValueType & s) const {
+        if (j >= T_->nCols()) return;
+        const Index * colPtr = T_->colPtr();
+        const Index * rowIdx = T_->rowIdx();
+        const Index * valIdx = T_->valIdx();
+        for (Index k = colPtr[j]; k < colPtr[j + 1]; k ++){
+            Index i = rowIdx[k];
+            if ((lower && i > j) || (!lower && i < j)) s += a_[i] * vals_[valIdx[k]];
+        }
+    }
+
+    ValueType * ret_;
+    const ValueType * a_;
+    const IndexType * rowPtr_;
+    const IndexType * colIdx_;
+    const ValueType * vals_;
+    const CRSTransposedPattern< IndexType > * T_;
+    Index nRows_;
+    int stype_;
+    bool trans_;
+};
+
+/*! Return the product of CRS arrays with a. ret = A * a or ret = A.T * a for
+ * trans. Uses threadCount() threads for large matrices. The transposed
+ * pattern T is only build for threaded transposed or symmetric products,
+ * the serial fallback scatters in row order. */
+template < class ValueType, class IndexType >
+void multCRS(Vector < ValueType > & ret, const Vector < ValueType > & a,
+             Index nRows, Index nCols,
+             const IndexType * rowPtr, const IndexType * colIdx,
+             const ValueType * vals, int stype, bool trans,
+             CRSTransposedPattern< IndexType > & T){
+
+    Index nOut = ret.size();
+    if (nOut == 0) return;
+
+    Index nThreads = threadCount();
+    if (Index(rowPtr[nRows]) < SPARSE_MULT_MT_MIN_VALS) nThreads = 1;
+    nThreads = min(nThreads, nOut);
+
+    if (nThreads < 2 && (trans || stype != 0)){
+        for (Index i = 0; i < nRows; i ++){
+            for (IndexType k = rowPtr[i]; k < rowPtr[i + 1]; k ++){
+                Index J = colIdx[k];
+                if (stype == 0){
+                    ret[J] += a[i] * vals[k];
+                } else if (trans){
+                    ret[J] += a[i] * conj(vals[k]);
+                    if ((stype == -1 && J > i) || (stype == 1 && J < i)){
+                        ret[i] += a[J] * vals[k];
+                    }
+                } else {
+                    ret[i] += a[J] * conj(vals[k]);
+                    if ((stype == -1 && J > i) || (stype == 1 && J < i)){
+                        ret[J] += a[i] * vals[k];
+                    }
+                }
+            }
+        }
+        return;
+    }
+
+    if (trans || stype != 0) T.update(nRows, nCols, rowPtr, colIdx);
+
+    CRSMultMT< ValueType, IndexType > calc(&ret[0], a.size() ? &a[0] : 0,
+                                          rowPtr, colIdx, vals, &T,
+                                          nRows, stype, trans);
+    if (nThreads < 2){
+        calc.setRange(0, nOut);
+        calc();
+    } else {
+        distributeCalc(calc, nOut, nThreads);
+    }
+}
+
 //! based on: Ulrich Breymann, Addison Wesley Longman 2000 , revised edition ISBN 0-201-67488-2, Designing Components with the C++ STL
+/*! The matrix entries live in a std::map or, after \ref finalize, in
+ * compressed row storage (CRS) arrays. Both are built lazily from each
+ * other on demand, mult and transMult always work on the CRS arrays.
+ * Writes to entries of the CRS pattern change the values in place, only
+ * new entries drop the CRS arrays.
+ *
+ * With \ref setBuildMode all writes (operator [], setVal, addVal, add) are
+ * collected as (row, col, value) triplets without any search. The
+ * triplets are sorted and merged in bulk, in the order they were written,
+ * as soon as the matrix is read or finalized. */
 template< class ValueType, class IndexType >
 class SparseMapMatrix : public MatrixBase {
 public:
@@ -154,53 +556,45 @@ public:
     typedef typename ContainerType::const_iterator    const_iterator;
     typedef MatrixElement< ValueType, IndexType, ContainerType > MatElement;
 
+    friend class MatrixElement< ValueType, IndexType, ContainerType >;
+
     /*!stype .. symmetric style. stype=0 (full), stype=1 (UpperRight), stype=2 (LowerLeft)*/
     SparseMapMatrix(IndexType r=0, IndexType c=0, int stype=0)
-        : MatrixBase(), rows_(r), cols_(c), stype_(stype) {
+        : MatrixBase(), rows_(r), cols_(c), stype_(stype),
+          buildMode_(false), mapValid_(true), crsValid_(false) {
     }
 
     SparseMapMatrix(const std::string & filename)
-        : MatrixBase(), rows_(0), cols_(0), stype_(0) {
+        : MatrixBase(), rows_(0), cols_(0), stype_(0),
+          buildMode_(false), mapValid_(true), crsValid_(false) {
         this->load(filename);
     }
 
     SparseMapMatrix(const SparseMapMatrix< ValueType, IndexType > & S)
         : MatrixBase(){
-        clear();
-        cols_ = S.cols();
-        rows_ = S.rows();
-        stype_ = S.stype();
-
-        for (const_iterator it = S.begin(); it != S.end(); it ++){
-            this->setVal(it->first.first, it->first.second, it->second);
-        }
+        this->assign_(S);
     }
     SparseMapMatrix(const SparseMatrix< ValueType > & S)
-        : MatrixBase(){
+        : MatrixBase(), buildMode_(false), mapValid_(true), crsValid_(false){
         this->copy_(S);
     }
 
     /*! Contruct Map Matrix from 3 arrays of the same length.
      *Number of colums are max(j)+1 and Number of rows are max(i)+1.*/
     SparseMapMatrix(const IndexArray & i, const IndexArray & j, const RVector & v)
-        : MatrixBase(){
+        : MatrixBase(), buildMode_(true), mapValid_(true), crsValid_(false){
         ASSERT_EQUAL(i.size(), j.size())
         ASSERT_EQUAL(i.size(), v.size())
         stype_ = 0;
         cols_ = max(j)+1;
         rows_ = max(i)+1;
         for (Index n = 0; n < i.size(); n ++ ) (*this)[i[n]][j[n]] = v[n];
+        this->setBuildMode(false);
     }
 
     SparseMapMatrix< ValueType, IndexType > & operator = (const SparseMapMatrix< ValueType, IndexType > & S){
         if (this != &S){
-            clear();
-            cols_ = S.cols();
-            rows_ = S.rows();
-            stype_ = S.stype();
-            for (const_iterator it = S.begin(); it != S.end(); it ++){
-                this->setVal(it->first.first, it->first.second, it->second);
-            }
+            this->assign_(S);
         } return *this;
     }
 
@@ -222,6 +616,134 @@ public:
     void copy_(const SparseMatrix< double > & S);
     void copy_(const SparseMatrix< Complex > & S);
 
+    /*! Switch the build mode on or off. In build mode every write is
+     * appended to a triplet buffer. Switching it off finalizes the matrix. */
+    void setBuildMode(bool buildMode){
+        buildMode_ = buildMode;
+        if (!buildMode_) this->finalize();
+    }
+
+    /*! Return true if the matrix collects its entries as triplets. */
+    inline bool buildMode() const { return buildMode_; }
+
+    /*! Merge all pending triplets in bulk into the compressed row storage.
+     * Duplicated entries are assigned or accumulated in the order they
+     * have been written. Called implicitly by every read access. */
+    void finalize() const {
+        if (tripRow_.empty()) return;
+        if (!crsValid_) this->fillCRS_();
+
+        Index nT = tripRow_.size();
+        Index nRows = max(Index(rows_), Index(crsRowPtr_.size() - 1));
+        for (Index t = 0; t < nT; t ++) nRows = max(nRows, Index(tripRow_[t] + 1));
+
+        // counting sort of the triplets into rows, keeps the write order
+        std::vector< Index > rowStart(nRows + 1, 0);
+        for (Index t = 0; t < nT; t ++) rowStart[tripRow_[t] + 1] ++;
+        for (Index i = 0; i < nRows; i ++) rowStart[i + 1] += rowStart[i];
+
+        std::vector< Index > perm(nT);
+        std::vector< Index > pos(rowStart.begin(), rowStart.end() - 1);
+        for (Index t = 0; t < nT; t ++) perm[pos[tripRow_[t]] ++] = t;
+
+        const std::vector< IndexType > & tCol = tripCol_;
+        for (Index i = 0; i < nRows; i ++){
+            if (rowStart[i + 1] - rowStart[i] > 1){
+                std::stable_sort(perm.begin() + rowStart[i],
+                                 perm.begin() + rowStart[i + 1],
+                                 [&tCol](Index a, Index b){
+                                     return tCol[a] < tCol[b]; });
+            }
+        }
+
+        // merge the sorted triplets with the existing rows
+        Index nOld = crsRowPtr_.size() - 1;
+        std::vector< IndexType > rowPtr(nRows + 1);
+        std::vector< IndexType > colIdx;
+        std::vector< ValueType > vals;
+        colIdx.reserve(crsColIdx_.size() + nT);
+        vals.reserve(crsColIdx_.size() + nT);
+
+        rowPtr[0] = 0;
+        for (Index i = 0; i < nRows; i ++){
+            Index k = 0, kEnd = 0;
+            if (i < nOld) {
+                k = crsRowPtr_[i];
+                kEnd = crsRowPtr_[i + 1];
+            }
+            Index t = rowStart[i], tEnd = rowStart[i + 1];
+
+            while (k < kEnd || t < tEnd){
+                IndexType col;
+                ValueType v(0);
+                if (t == tEnd || (k < kEnd && crsColIdx_[k] < tripCol_[perm[t]])){
+                    col = crsColIdx_[k];
+                    v = crsVals_[k];
+                    k ++;
+                } else {
+                    col = tripCol_[perm[t]];
+                    if (k < kEnd && crsColIdx_[k] == col){
+                        v = crsVals_[k];
+                        k ++;
+                    }
+                    for (; t < tEnd && tripCol_[perm[t]] == col; t ++){
+                        if (tripAssign_[perm[t]]) v = tripVal_[perm[t]];
+                        else v += tripVal_[perm[t]];
+                    }
+                }
+                colIdx.push_back(col);
+                vals.push_back(v);
+            }
+            rowPtr[i + 1] = colIdx.size();
+        }
+
+        crsRowPtr_.swap(rowPtr);
+        crsColIdx_.swap(colIdx);
+        crsVals_.swap(vals);
+        crsValid_ = true;
+        T_.invalidate();
+        mapValid_ = false;
+        C_.clear();
+
+        std::vector< IndexType >().swap(tripRow_);
+        std::vector< IndexType >().swap(tripCol_);
+        std::vector< ValueType >().swap(tripVal_);
+        std::vector< uint8 >().swap(tripAssign_);
+    }
+
+    /*! Append the pending build mode writes of B in their write order,
+     * as if they had been written to this matrix directly. Both matrices
+     * need to be in build mode. The writes are removed from B. */
+    void appendBuild(SparseMapMatrix< ValueType, IndexType > & B){
+        if (!buildMode_ || !B.buildMode()){
+            throwError(WHERE_AM_I + " both matrices need to be in build mode.");
+        }
+        tripRow_.insert(tripRow_.end(), B.tripRow_.begin(), B.tripRow_.end());
+        tripCol_.insert(tripCol_.end(), B.tripCol_.begin(), B.tripCol_.end());
+        tripVal_.insert(tripVal_.end(), B.tripVal_.begin(), B.tripVal_.end());
+        tripAssign_.insert(tripAssign_.end(), B.tripAssign_.begin(), B.tripAssign_.end());
+        if (B.rows_ > rows_) rows_ = B.rows_;
+        if (B.cols_ > cols_) cols_ = B.cols_;
+
+        std::vector< IndexType >().swap(B.tripRow_);
+        std::vector< IndexType >().swap(B.tripCol_);
+        std::vector< ValueType >().swap(B.tripVal_);
+        std::vector< uint8 >().swap(B.tripAssign_);
+    }
+
+    /*! Return the row pointer of the finalized compressed row storage. */
+    inline const std::vector< IndexType > & crsRowPtr() const {
+        this->syncCRS_(); return crsRowPtr_;
+    }
+    /*! Return the column indices of the finalized compressed row storage. */
+    inline const std::vector< IndexType > & crsColIdx() const {
+        this->syncCRS_(); return crsColIdx_;
+    }
+    /*! Return the values of the finalized compressed row storage. */
+    inline const std::vector< ValueType > & crsVals() const {
+        this->syncCRS_(); return crsVals_;
+    }
+
     /*! Add this values to the matrix. */
     inline void add(const IndexArray & rows, const IndexArray & cols,
                     const RVector & vals) {
@@ -235,6 +757,15 @@ public:
 
     virtual void clear() {
         C_.clear();
+        crsRowPtr_.clear();
+        crsColIdx_.clear();
+        crsVals_.clear();
+        tripRow_.clear();
+        tripCol_.clear();
+        tripVal_.clear();
+        tripAssign_.clear();
+        mapValid_ = true;
+        crsValid_ = false;
         cols_ = 0; rows_ = 0; stype_ = 0;
     }
 
@@ -272,15 +803,19 @@ public:
     virtual IndexType cols()     const { return cols_; }
     virtual IndexType nCols()     const { return cols_; }
 
-    inline IndexType size()     const { return C_.size(); }
+    inline IndexType size()     const { return this->nVals(); }
     inline IndexType max_size() const { return C_.max_size(); }
-    inline IndexType nVals()    const { return C_.size(); }
+    inline IndexType nVals()    const {
+        this->finalize();
+        if (mapValid_) return C_.size();
+        return crsVals_.size();
+    }
 
-    inline iterator begin() { return C_.begin(); }
-    inline iterator end() { return C_.end(); }
+    inline iterator begin() { this->touchMap_(); return C_.begin(); }
+    inline iterator end() { this->touchMap_(); return C_.end(); }
 
-    inline const_iterator begin() const { return C_.begin(); }
-    inline const_iterator end()   const { return C_.end(); }
+    inline const_iterator begin() const { this->syncMap_(); return C_.begin(); }
+    inline const_iterator end()   const { this->syncMap_(); return C_.end(); }
 
     /*!Scale with scale */
     void add(const ElementMatrix < double > & A, ValueType scale=1.0);
@@ -297,7 +832,9 @@ public:
 
 #define DEFINE_SPARSEMAPMATRIX_UNARY_MOD_OPERATOR__(OP) \
     SparseMapMatrix< ValueType, IndexType > & operator OP##= (const ValueType & v){\
-        for (iterator it = begin(); it != end(); it ++) (*it).second OP##= v; \
+        this->finalize(); \
+        if (crsValid_) for (Index i = 0; i < crsVals_.size(); i ++) crsVals_[i] OP##= v; \
+        if (mapValid_) for (iterator it = C_.begin(); it != C_.end(); it ++) (*it).second OP##= v; \
         return *this; \
     } \
 
@@ -332,8 +869,9 @@ public:
 
     class Aux {  // for index operator below
     public:
-        Aux(IndexType r, IndexType maxs, ContainerType & Cont, int stype)
-            : Row(r), maxColumns(maxs), C(Cont), stype_(stype) { }
+        Aux(IndexType r, IndexType maxs, ContainerType & Cont, int stype,
+            SparseMapMatrix< ValueType, IndexType > * M=0)
+            : Row(r), maxColumns(maxs), C(Cont), stype_(stype), M_(M) { }
 
         MatElement operator [] (IndexType c) {
 //             __MS( stype_ << " " << c << " " << Row )
@@ -342,12 +880,14 @@ public:
                                   WHERE_AM_I + " idx = " + str(c) + ", " + str(Row) + " maxcol = "
                                   + str(maxColumns) + " stype: " + str(stype_));
             }
+            if (M_) return MatElement(*M_, C, Row, c);
             return MatElement(C, Row, c);
         }
     protected:
         IndexType Row, maxColumns;
         ContainerType & C;
         int stype_;
+        SparseMapMatrix< ValueType, IndexType > * M_;
     };
 
     Aux operator [] (IndexType r) {
@@ -356,7 +896,7 @@ public:
                               WHERE_AM_I + " idx = " + str(r) + " maxrow = "
                               + str(rows_));
         }
-        return Aux(r, cols(), C_, stype_);
+        return Aux(r, cols(), C_, stype_, this);
     }
 
     inline IndexType idx1(const const_iterator & I) const { return (*I).first.first; }
@@ -367,25 +907,45 @@ public:
 
     inline const ValueType & val(const const_iterator & I) const { return (*I).second;  }
 
-    inline ValueType & val(const iterator & I) { return (*I).second;  }
+    inline ValueType & val(const iterator & I) { crsValid_ = false; return (*I).second;  }
 
     inline Vector< ValueType > values() const {
-        Vector< ValueType > ret(C_.size());
-        Index i = 0;
-        for (const_iterator it = this->begin(); it != this->end(); it ++, i ++){
-            ret[i] = val(it);
-        }
+        this->syncCRS_();
+        Vector< ValueType > ret(crsVals_.size());
+        for (Index i = 0; i < crsVals_.size(); i ++) ret[i] = crsVals_[i];
         return ret;
     }
 
-    inline ValueType getVal(IndexType i, IndexType j) { return (*this)[i][j]; }
+    inline ValueType getVal(IndexType i, IndexType j) const {
+        if ((i < 0 || i >= rows_) || (j < 0 || j >= cols_) ||
+            (stype_ < 0 && j < i) || (stype_ > 0 && j > i)) {
+            throwLengthError(WHERE_AM_I + " idx = " + str(i) + ", " + str(j)
+                             + " maxrow = " + str(rows_)
+                             + " maxcol = " + str(cols_)
+                             + " stype: " + str(stype_));
+        }
+        this->finalize();
+        if (mapValid_){
+            const_iterator it = C_.find(IndexPair(i, j));
+            if (it == C_.end()) return ValueType(0);
+            return it->second;
+        }
+        if (Index(i) + 1 >= crsRowPtr_.size()) return ValueType(0);
+        typename std::vector< IndexType >::const_iterator
+            first = crsColIdx_.begin() + crsRowPtr_[i],
+            last = crsColIdx_.begin() + crsRowPtr_[i + 1];
+        typename std::vector< IndexType >::const_iterator
+            it = std::lower_bound(first, last, j);
+        if (it == last || *it != j) return ValueType(0);
+        return crsVals_[it - crsColIdx_.begin()];
+    }
 
     inline void setVal(IndexType i, IndexType j, const ValueType & val) {
         if ((stype_ < 0 && i > j) || (stype_ > 0 && i < j)) return;
 
         if (i >= rows_) rows_ = i+1;
         if (j >= cols_) cols_ = j+1;
-        (*this)[i][j] = val;
+        this->write_(i, j, val, true);
         // if ((i >= 0 && i < rows_) && (j >=0 && j < cols_)) {
         // } else {
         //     throwLengthError(
@@ -399,7 +959,7 @@ public:
         if ((stype_ < 0 && i > j) || (stype_ > 0 && i < j)) return;
         if (i >= rows_) rows_ = i+1;
         if (j >= cols_) cols_ = j+1;
-        (*this)[i][j] += val;
+        this->write_(i, j, val, false);
 
         // if ((i >= 0 && i < rows_) && (j >=0 && j < cols_)) {
         //     (*this)[i][j] += val;
@@ -419,35 +979,11 @@ public:
 
         ASSERT_EQUAL(this->cols(), a.size())
 
-        if (stype_ == 0){
-            for (const_iterator it = this->begin(); it != this->end(); it ++){
-                ret[it->first.first] += a[it->first.second] * it->second;
-            }
-        } else if (stype_ == -1){
-
-            for (const_iterator it = this->begin(); it != this->end(); it ++){
-                IndexType I = it->first.first;
-                IndexType J = it->first.second;
-
-                ret[I] += a[J] * conj(it->second);
-
-                if (J > I){
-                    ret[J] += a[I] * it->second;
-                }
-            }
-        } else if (stype_ ==  1){
-            for (const_iterator it = this->begin(); it != this->end(); it ++){
-                IndexType I = it->first.first;
-                IndexType J = it->first.second;
-
-                ret[I] += a[J] * conj(it->second);
-
-                if (J < I){
-                    ret[J] += a[I] * it->second;
-                }
-            }
-
-        }
+        this->prepareMult_();
+        multCRS(ret, a, min(Index(this->rows()), Index(crsRowPtr_.size() - 1)),
+                this->cols(), &crsRowPtr_[0],
+                crsColIdx_.empty() ? 0 : &crsColIdx_[0],
+                crsVals_.empty() ? 0 : &crsVals_[0], stype_, false, T_);
         return ret;
     }
 
@@ -457,15 +993,11 @@ public:
 
         ASSERT_EQUAL(this->rows(), a.size())
 
-        if (stype_ == 0){
-            for (const_iterator it = this->begin(); it != this->end(); it ++){
-                ret[it->first.second] += a[it->first.first] * it->second;
-            }
-        } else if (stype_ == -1){
-            THROW_TO_IMPL
-        } else if (stype_ ==  1){
-            THROW_TO_IMPL
-        }
+        this->prepareMult_();
+        multCRS(ret, a, min(Index(this->rows()), Index(crsRowPtr_.size() - 1)),
+                this->cols(), &crsRowPtr_[0],
+                crsColIdx_.empty() ? 0 : &crsColIdx_[0],
+                crsVals_.empty() ? 0 : &crsVals_[0], stype_, true, T_);
         return ret;
     }
 
@@ -508,9 +1040,12 @@ public:
         setRows(IndexType(max(vi) + 1));
         setCols(IndexType(max(vj) + 1));
 
+        bool oldMode = buildMode_;
+        buildMode_ = true;
         for (Index i = 0; i < vi.size(); i ++){
             (*this)[vi[i]][vj[i]] = vval[i];
         }
+        this->setBuildMode(oldMode);
     }
 
     /*! Import columnwise from bmat starting at offset */
@@ -549,24 +1084,159 @@ public:
     /*! Fill existing arrays with values, row and column indieces of this
      * SparseMapMatrix*/
     void fillArrays(Vector < ValueType > & vals, IndexArray & rows, IndexArray & cols){
-        vals.resize(C_.size());
-        rows.resize(C_.size());
-        cols.resize(C_.size());
-        Index i = 0;
-
-        for (const_iterator it = this->begin(); it != this->end(); it ++, i ++){
-            rows[i] = idx1(it);
-            cols[i] = idx2(it);
-            vals[i] = val(it);
+        this->syncCRS_();
+        vals.resize(crsVals_.size());
+        rows.resize(crsVals_.size());
+        cols.resize(crsVals_.size());
+
+        for (Index i = 0; i < crsRowPtr_.size() - 1; i ++){
+            for (IndexType k = crsRowPtr_[i]; k < crsRowPtr_[i + 1]; k ++){
+                rows[k] = i;
+                cols[k] = crsColIdx_[k];
+                vals[k] = crsVals_[k];
+            }
         }
     }
 
 protected:
+    /*! Append one write to the triplet buffer. */
+    inline void pushTriplet_(IndexType i, IndexType j, const ValueType & v,
+                             bool assign){
+        tripRow_.push_back(i);
+        tripCol_.push_back(j);
+        tripVal_.push_back(v);
+        tripAssign_.push_back(assign);
+    }
+
+    /*! Assign or add v to entry i, j. In build mode the write is appended
+     * to the triplets. Entries of the CRS pattern are changed in place in
+     * the CRS arrays and the map, so mixed writes and products stay cheap.
+     * Only new entries are inserted into the map and drop the CRS arrays. */
+    void write_(IndexType i, IndexType j, const ValueType & v, bool assign){
+        if (buildMode_) {
+            this->pushTriplet_(i, j, v, assign);
+            return;
+        }
+        this->finalize();
+        if (crsValid_ && Index(i) + 1 < crsRowPtr_.size()){
+            typename std::vector< IndexType >::iterator
+                first = crsColIdx_.begin() + crsRowPtr_[i],
+                last = crsColIdx_.begin() + crsRowPtr_[i + 1];
+            typename std::vector< IndexType >::iterator
+                it = std::lower_bound(first, last, j);
+            if (it != last && *it == j){
+                ValueType & val = crsVals_[it - crsColIdx_.begin()];
+                if (assign) val = v; else val += v;
+                if (mapValid_) C_[IndexPair(i, j)] = val;
+                return;
+            }
+        }
+        this->touchMap_();
+        if (assign) C_[IndexPair(i, j)] = v; else C_[IndexPair(i, j)] += v;
+    }
+
+    /*! Build the CRS arrays from the map. */
+    void fillCRS_() const {
+        Index nRows = rows_;
+        if (!C_.empty()) nRows = max(nRows, Index(C_.rbegin()->first.first + 1));
+
+        crsRowPtr_.assign(nRows + 1, 0);
+        crsColIdx_.resize(C_.size());
+        crsVals_.resize(C_.size());
+
+        Index k = 0;
+        for (const_iterator it = C_.begin(); it != C_.end(); it ++, k ++){
+            crsRowPtr_[it->first.first + 1] ++;
+            crsColIdx_[k] = it->first.second;
+            crsVals_[k] = it->second;
+        }
+        for (Index i = 0; i < nRows; i ++) crsRowPtr_[i + 1] += crsRowPtr_[i];
+        crsValid_ = true;
+        T_.invalidate();
+    }
+
+    /*! Ensure the CRS arrays represent the matrix. */
+    inline void syncCRS_() const {
+        this->finalize();
+        if (!crsValid_) this->fillCRS_();
+        if (crsRowPtr_.size() < Index(rows_) + 1) {
+            crsRowPtr_.resize(rows_ + 1, crsRowPtr_.empty() ? 0 : crsRowPtr_.back());
+        }
+    }
+
+    /*! Ensure the map represents the matrix. Sorted CRS entries are
+     * inserted with end hint, i.e., in constant time each. */
+    inline void syncMap_() const {
+        this->finalize();
+        if (mapValid_) return;
+        C_.clear();
+        for (Index i = 0; i + 1 < crsRowPtr_.size(); i ++){
+            for (IndexType k = crsRowPtr_[i]; k < crsRowPtr_[i + 1]; k ++){
+                C_.insert(C_.end(), typename ContainerType::value_type(
+                    IndexPair(i, crsColIdx_[k]), crsVals_[k]));
+            }
+        }
+        mapValid_ = true;
+    }
+
+    /*! Ensure valid CRS arrays, safe for concurrent const calls. */
+    inline void prepareMult_() const {
+        std::lock_guard< std::mutex > lock(mutex_);
+        this->syncCRS_();
+    }
+
+    /*! The map is about to be changed so the CRS arrays become invalid. */
+    inline void touchMap_() {
+        this->syncMap_();
+        crsValid_ = false;
+    }
+
+    void assign_(const SparseMapMatrix< ValueType, IndexType > & S){
+        S.finalize();
+        rows_ = S.rows_;
+        cols_ = S.cols_;
+        stype_ = S.stype_;
+        buildMode_ = S.buildMode_;
+        mapValid_ = S.mapValid_;
+        crsValid_ = S.crsValid_;
+        if (mapValid_) C_ = S.C_; else C_.clear();
+        if (crsValid_) {
+            crsRowPtr_ = S.crsRowPtr_;
+            crsColIdx_ = S.crsColIdx_;
+            crsVals_ = S.crsVals_;
+        } else {
+            crsRowPtr_.clear();
+            crsColIdx_.clear();
+            crsVals_.clear();
+        }
+        tripRow_.clear();
+        tripCol_.clear();
+        tripVal_.clear();
+        tripAssign_.clear();
+    }
 
   IndexType rows_, cols_;
-  ContainerType C_;
+  mutable ContainerType C_;
   // 0 .. nonsymmetric, -1 symmetric lower part, 1 symmetric upper part
   int stype_;
+
+  bool buildMode_;
+  // pending writes of the build mode
+  mutable std::vector< IndexType > tripRow_;
+  mutable std::vector< IndexType > tripCol_;
+  mutable std::vector< ValueType > tripVal_;
+  mutable std::vector< uint8 > tripAssign_;
+
+  // compressed row storage, at least one of map or CRS is valid
+  mutable std::vector< IndexType > crsRowPtr_;
+  mutable std::vector< IndexType > crsColIdx_;
+  mutable std::vector< ValueType > crsVals_;
+  mutable bool mapValid_;
+  mutable bool crsValid_;
+
+  // transposed pattern for threaded transMult and symmetric mult
+  mutable CRSTransposedPattern< IndexType > T_;
+  mutable std::mutex mutex_;
 };// class SparseMapMatrix
 
 
@@ -700,11 +1370,115 @@ void rank1Update(SparseMapMatrix< double, Index > & S, const Vec & u, const Vec
 //     return S * Vector< V2 >(a);
 // }
 
+/*! Build the compressed row sparsity pattern of the node connections of
+ * all cells in the mesh. Row i holds the sorted ids of all nodes sharing a
+ * cell with node i. The rows are counted and filled on threadCount()
+ * threads, each for a range of nodes. Throws if the pattern does not fit
+ * into 32 bit indices, see \ref checkIndexRange. */
+DLLEXPORT void buildMeshSparsityPattern(const Mesh & mesh,
+                                        std::vector< int > & rowPtr,
+                                        std::vector< int > & colIdx);
+
+/*! Build the mesh sparsity pattern with 64 bit indices. */
+DLLEXPORT void buildMeshSparsityPattern(const Mesh & mesh,
+                                        std::vector< SIndex > & rowPtr,
+                                        std::vector< SIndex > & colIdx);
+
+/*! Greedy coloring of the mesh cells. Cells of the same color share no
+ * node, so their element matrices can be added to a matrix concurrently.
+ * colors[i] holds the increasing cell indices of color i. */
+DLLEXPORT void colorMeshCells(const Mesh & mesh,
+                              std::vector< IndexArray > & colors);
+
+//! Cache for the last sparsity pattern built for a mesh.
+/*! Pattern, scatter map and cell colors are reused while the
+ * \ref meshPatternHash and the node, cell and boundary count of the mesh
+ * stay the same. Only patterns with 32 bit indices are cached, 64 bit ones
+ * are too large to be kept twice. The scatter map is shared with the
+ * matrices and only referenced weakly, so it is freed with the last matrix
+ * using it. Thread safe. */
+class DLLEXPORT SparsityPatternCache : public Singleton< SparsityPatternCache > {
+public:
+    friend class Singleton< SparsityPatternCache >;
+
+    /*! Copy the cached pattern for the mesh into rowPtr and colIdx and
+     * share the scatter map into map, if given. The map is reset if there
+     * is none alive. Return false if there is no pattern for the mesh. */
+    bool get(const Mesh & mesh, Index hash,
+             std::vector< int > & rowPtr, std::vector< int > & colIdx,
+             std::shared_ptr< const ElementScatterMap< int > > * map=0) const;
+
+    /*! Store the pattern for the mesh and refer to the scatter map, if given. */
+    void set(const Mesh & mesh, Index hash,
+             const std::vector< int > & rowPtr, const std::vector< int > & colIdx,
+             const std::shared_ptr< const ElementScatterMap< int > > * map=0);
+
+    /*! Copy the cell colors for the mesh into colors, see \ref colorMeshCells.
+     * They are created if there are none cached. */
+    void cellColors(const Mesh & mesh, Index hash,
+                    std::vector< IndexArray > & colors);
+
+    /*! Free the cache. */
+    void clear();
+
+protected:
+    SparsityPatternCache()
+        : hash_(0), nNodes_(0), nCells_(0), nBounds_(0),
+          hasPattern_(false), hasColors_(false) { }
+
+    bool match_(const Mesh & mesh, Index hash) const;
+
+    /*! Bind the cache to the mesh and drop the content if it changed. */
+    void reset_(const Mesh & mesh, Index hash);
+
+    mutable std::mutex mutex_;
+    Index hash_;
+    Index nNodes_;
+    Index nCells_;
+    Index nBounds_;
+    bool hasPattern_;
+    bool hasColors_;
+    std::vector< int > rowPtr_;
+    std::vector< int > colIdx_;
+    std::weak_ptr< const ElementScatterMap< int > > map_;
+    std::vector< IndexArray > colors_;
+};
+
+//! Element matrices of a range of cells added to a SparseMatrix.
+/*! If cells is given, the range refers to the cell indices in cells. */
+template < class ValueType, class IndexType, class Fill >
+class AssembleCellsMT : public BaseCalcMT {
+public:
+    AssembleCellsMT(SparseMatrix< ValueType, IndexType > * S, const Mesh * mesh,
+                    const Fill * fill, const IndexArray * cells)
+    : BaseCalcMT(false), S_(S), mesh_(mesh), fill_(fill), cells_(cells) { }
+
+    virtual ~AssembleCellsMT(){}
+
+    virtual void calc(){
+        ElementMatrix < double > A;
+        ElementMatrix < double > tmp;
+        ValueType scale(1.0);
+        for (Index i = start_; i < end_; i ++){
+            Index c = cells_ ? (*cells_)[i] : i;
+            if ((*fill_)(mesh_->cell(c), A, tmp, scale)){
+                S_->addCell(c, A, scale);
+            }
+        }
+    }
+
+protected:
+    SparseMatrix< ValueType, IndexType > * S_;
+    const Mesh * mesh_;
+    const Fill * fill_;
+    const IndexArray * cells_;
+};
+
 //! Sparse matrix in compressed row storage (CRS) form
 /*! Sparse matrix in compressed row storage (CRS) form.
 * IF you need native CCS format you need to transpose CRS
 * Symmetry type: 0 = nonsymmetric, -1 symmetric lower part, 1 symmetric upper part.*/
-template < class ValueType > class SparseMatrix : public MatrixBase{
+template < class ValueType, class IndexType > class SparseMatrix : public MatrixBase{
 public:
 
   /*! Default constructor. Builds invalid sparse matrix */
@@ -712,11 +1486,12 @@ public:
         : MatrixBase(), valid_(false), stype_(0), rows_(0), cols_(0){ }
 
     /*! Copy constructor. */
-    SparseMatrix(const SparseMatrix < ValueType > & S)
+    SparseMatrix(const SparseMatrix < ValueType, IndexType > & S)
         : MatrixBase(),
           colPtr_(S.vecColPtr()),
           rowIdx_(S.vecRowIdx()),
-          vals_(S.vecVals()), valid_(true), stype_(0){
+          vals_(S.vecVals()), valid_(true), stype_(0),
+          scatterMap_(S.scatterMap_){
           rows_ = S.rows();
           cols_ = S.cols();
     }
@@ -730,8 +1505,8 @@ public:
                  const IndexArray & rowIdx,
                  const Vector < ValueType > vals, int stype=0)
         : MatrixBase(){
-        colPtr_ = std::vector < int >(colPtr.size());
-        rowIdx_ = std::vector < int >(rowIdx.size());
+        colPtr_ = std::vector < IndexType >(colPtr.size());
+        rowIdx_ = std::vector < IndexType >(rowIdx.size());
         for (Index i = 0; i < colPtr_.size(); i ++ ) colPtr_[i] = colPtr[i];
         for (Index i = 0; i < rowIdx_.size(); i ++ ) rowIdx_[i] = rowIdx[i];
         vals_   = vals;
@@ -741,8 +1516,8 @@ public:
         rows_ = colPtr_.size() - 1;
     }
 
-    SparseMatrix(const std::vector < int > & colPtr,
-                 const std::vector < int > & rowIdx,
+    SparseMatrix(const std::vector < IndexType > & colPtr,
+                 const std::vector < IndexType > & rowIdx,
                  const Vector < ValueType > vals, int stype=0)
         : MatrixBase(){
           colPtr_ = colPtr;
@@ -758,7 +1533,7 @@ public:
     virtual ~SparseMatrix(){ }
 
     /*! Copy assignment operator. */
-    SparseMatrix < ValueType > & operator = (const SparseMatrix < ValueType > & S){
+    SparseMatrix < ValueType, IndexType > & operator = (const SparseMatrix < ValueType, IndexType > & S){
         if (this != &S){
             colPtr_ = S.vecColPtr();
             rowIdx_ = S.vecRowIdx();
@@ -767,20 +1542,21 @@ public:
             valid_  = true;
             cols_ = S.cols();
             rows_ = S.rows();
-
+            T_.invalidate();
+            scatterMap_ = S.scatterMap_;
         } return *this;
     }
 
-    SparseMatrix < ValueType > & operator = (const SparseMapMatrix< ValueType, Index > & S){
+    SparseMatrix < ValueType, IndexType > & operator = (const SparseMapMatrix< ValueType, Index > & S){
         this->copy_(S);
         return *this;
     }
 
     #define DEFINE_SPARSEMATRIX_UNARY_MOD_OPERATOR__(OP, FUNCT) \
-        void FUNCT(int i, int j, ValueType val){ \
+        void FUNCT(IndexType i, IndexType j, ValueType val){ \
             if ((stype_ < 0 && i > j) || (stype_ > 0 && i < j)) return; \
             if (abs(val) > TOLERANCE || 1){ \
-                for (int k = colPtr_[i]; k < colPtr_[i + 1]; k ++){ \
+                for (IndexType k = colPtr_[i]; k < colPtr_[i + 1]; k ++){ \
                     if (rowIdx_[k] == j) { \
                         vals_[k] OP##= val; return; \
                     } \
@@ -788,7 +1564,7 @@ public:
                 std::cerr << WHERE_AM_I << " pos " << i << " " << j << " is not part of the sparsity pattern " << std::endl; \
             } \
         }\
-        SparseMatrix< ValueType > & operator OP##= (const ValueType & v){\
+        SparseMatrix< ValueType, IndexType > & operator OP##= (const ValueType & v){\
             vals_ OP##= v; \
             return *this;\
         }\
@@ -800,16 +1576,16 @@ public:
 
     #undef DEFINE_SPARSEMATRIX_UNARY_MOD_OPERATOR__
 
-    SparseMatrix< ValueType > & operator += (const SparseMatrix< ValueType > & A){
+    SparseMatrix< ValueType, IndexType > & operator += (const SparseMatrix< ValueType, IndexType > & A){
         vals_ += A.vecVals();
         return *this;
     }
-    SparseMatrix< ValueType > & operator -= (const SparseMatrix< ValueType > & A){
+    SparseMatrix< ValueType, IndexType > & operator -= (const SparseMatrix< ValueType, IndexType > & A){
         vals_ -= A.vecVals();
         return *this;
     }
 
-    SparseMatrix< ValueType > & operator += (const ElementMatrix< double > & A){
+    SparseMatrix< ValueType, IndexType > & operator += (const ElementMatrix< double > & A){
         if (!valid_) SPARSE_NOT_VALID;
         for (Index i = 0, imax = A.size(); i < imax; i++){
             for (Index j = 0, jmax = A.size(); j < jmax; j++){
@@ -829,48 +1605,11 @@ public:
         }
 
         Vector < ValueType > ret(this->rows(), 0.0);
+        if (colPtr_.empty()) return ret;
 
-        if (stype_ == 0){
-            // for each row
-            for (Index i = 0; i < this->rows(); i++){
-            // iterate through compressed col
-                for (int j = this->vecColPtr()[i]; j < this->vecColPtr()[i + 1]; j ++){
-                    ret[i] += a[this->vecRowIdx()[j]] * this->vecVals()[j];
-                }
-            }
-        } else if (stype_ == -1){
-            Index J;
-            for (Index i = 0; i < ret.size(); i++){
-                for (int j = this->vecColPtr()[i]; j < this->vecColPtr()[i + 1]; j ++){
-                    J = this->vecRowIdx()[j];
-
-//                     __MS( i << "  " << J << " " << this->vecVals()[j])
-                    ret[i] += a[J] * conj(this->vecVals()[j]);
-
-                    if (J > i){
-//                         __MS( J << "  " << i << " " << this->vecVals()[j])
-                        ret[J] += a[i] * this->vecVals()[j];
-                    }
-                }
-            }
-
-            //#THROW_TO_IMPL
-        } else if (stype_ == 1){
-            Index J;
-            for (Index i = 0; i < ret.size(); i++){
-                for (int j = this->vecColPtr()[i]; j < this->vecColPtr()[i + 1]; j ++){
-                    J = this->vecRowIdx()[j];
-
-//                     __MS( i << "  " << J << " " << this->vecVals()[j])
-                    ret[i] += a[J] * conj(this->vecVals()[j]);
-
-                    if (J < i){
-//                         __MS( J << "  " << i << " " << this->vecVals()[j])
-                        ret[J] += a[i] * this->vecVals()[j];
-                    }
-                }
-            }
-        }
+        multCRS(ret, a, this->rows(), this->cols(), &colPtr_[0],
+                rowIdx_.empty() ? 0 : &rowIdx_[0],
+                vals_.size() ? &vals_[0] : 0, stype_, false, T_);
         return ret;
     }
 
@@ -883,19 +1622,11 @@ public:
         }
 
         Vector < ValueType > ret(this->cols(), 0.0);
+        if (colPtr_.empty()) return ret;
 
-        if (stype_ == 0){
-            for (Index i = 0; i < this->rows(); i++){
-                for (int j = this->vecColPtr()[i]; j < this->vecColPtr()[i + 1]; j ++){
-                    ret[this->vecRowIdx()[j]] += a[i] * this->vecVals()[j];
-                }
-            }
-
-        } else if (stype_ == -1){
-            THROW_TO_IMPL
-        } else if (stype_ ==  1){
-            THROW_TO_IMPL
-        }
+        multCRS(ret, a, this->rows(), this->cols(), &colPtr_[0],
+                rowIdx_.empty() ? 0 : &rowIdx_[0],
+                vals_.size() ? &vals_[0] : 0, stype_, true, T_);
         return ret;
     }
 
@@ -909,6 +1640,54 @@ public:
     void add(const ElementMatrix< double > & A,
              const Matrix < ValueType > & scale);
 
+    /*! Add the element matrix A, filled for mesh.cell(cellIdx), with scale.
+     * Uses the scatter map (see \ref buildScatterMap) if there is one,
+     * so the sparsity pattern needs not to be searched for the entries. */
+    void addCell(Index cellIdx, const ElementMatrix< double > & A,
+                 const ValueType & scale){
+        addScattered_(scatterMap_ ? scatterMap_->cell(cellIdx, A.size()) : 0,
+                      A, scale);
+    }
+
+    /*! Add the element matrices of all mesh cells. fill(cell, A, tmp, scale)
+     * fills A (tmp is a workspace) and the scale for the cell and returns
+     * false to skip the cell. Large meshes are assembled on threadCount()
+     * threads color by color (see \ref colorMeshCells), so the threads add
+     * to disjoint values without locking. The summation order only depends
+     * on the number of threads, so results are bitwise reproducible. */
+    template < class Fill >
+    void assembleCells(const Mesh & mesh, const Fill & fill){
+        if (!valid_) SPARSE_NOT_VALID;
+
+        Index nThreads = threadCount();
+        if (mesh.cellCount() < SPARSE_ASSEMBLY_MT_MIN_CELLS) nThreads = 1;
+
+        if (nThreads < 2){
+            AssembleCellsMT< ValueType, IndexType, Fill > calc(this, &mesh, &fill, 0);
+            calc.setRange(0, mesh.cellCount());
+            calc.calc();
+            return;
+        }
+
+        fillShapeFunctionCache(mesh);
+        std::vector< IndexArray > colors;
+        SparsityPatternCache::instance().cellColors(mesh, meshPatternHash(mesh), colors);
+
+        for (Index i = 0; i < colors.size(); i ++){
+            AssembleCellsMT< ValueType, IndexType, Fill > calc(this, &mesh, &fill, &colors[i]);
+            distributeCalc(calc, colors[i].size(),
+                           min(nThreads, Index(colors[i].size())));
+        }
+    }
+
+    /*! Add the element matrix A, filled for mesh.boundary(boundIdx), with scale.
+     * Uses the scatter map (see \ref buildScatterMap) if there is one. */
+    void addBoundary(Index boundIdx, const ElementMatrix< double > & A,
+                     const ValueType & scale){
+        addScattered_(scatterMap_ ? scatterMap_->boundary(boundIdx, A.size()) : 0,
+                      A, scale);
+    }
+
     void clean(){ for (Index i = 0, imax = nVals(); i < imax; i++) vals_[i] = (ValueType)(0); }
 
     void clear(){
@@ -918,11 +1697,13 @@ public:
         valid_ = false;
         cols_ = 0;
         rows_ = 0;
+        T_.invalidate();
+        scatterMap_.reset();
     }
 
-    void setVal(int i, int j, ValueType val){
+    void setVal(IndexType i, IndexType j, ValueType val){
         if (abs(val) > TOLERANCE || 1){
-            for (int k = colPtr_[i]; k < colPtr_[i + 1]; k ++){
+            for (IndexType k = colPtr_[i]; k < colPtr_[i + 1]; k ++){
                 if (rowIdx_[k] == j) {
                     vals_[k] = val; return;
                 }
@@ -934,8 +1715,8 @@ public:
     /*!Get matrix value at i,j. If i and j is not part of the matrix
      * sparsity pattern return 0 and print a warning.
      * This warning can be disabled by setting warn to false.*/
-    ValueType getVal(int i, int j, bool warn=true) const {
-        for (int k = colPtr_[i]; k < colPtr_[i + 1]; k ++){
+    ValueType getVal(IndexType i, IndexType j, bool warn=true) const {
+        for (IndexType k = colPtr_[i]; k < colPtr_[i + 1]; k ++){
             if (rowIdx_[k] == j) {
                 return vals_[k];
             }
@@ -945,16 +1726,16 @@ public:
         return ValueType(0);
     }
 
-    void cleanRow(int row){
-        ASSERT_RANGE(row, 0, (int)this->rows())
-        for (int col = colPtr_[row]; col < colPtr_[row + 1]; col ++){
+    void cleanRow(IndexType row){
+        ASSERT_RANGE(row, 0, (IndexType)this->rows())
+        for (IndexType col = colPtr_[row]; col < colPtr_[row + 1]; col ++){
             vals_[col] = ValueType(0);
         }
     }
 
-    void cleanCol(int col){
-        ASSERT_RANGE(col, 0, (int)this->cols())
-        for (int i = 0; i < (int)this->rowIdx_.size(); i++){
+    void cleanCol(IndexType col){
+        ASSERT_RANGE(col, 0, (IndexType)this->cols())
+        for (Index i = 0; i < this->rowIdx_.size(); i++){
             if (rowIdx_[i] == col) {
                 vals_[i] = ValueType(0);
             }
@@ -963,74 +1744,67 @@ public:
     void copy_(const SparseMapMatrix< double, Index > & S);
     void copy_(const SparseMapMatrix< Complex, Index > & S);
 
-    void buildSparsityPattern(const Mesh & mesh){
-        Stopwatch swatch(true);
-
-        colPtr_.resize(mesh.nodeCount() + 1);
-
-        //*** much to slow
-        //RSparseMapMatrix S(mesh.nodeCount(), mesh.nodeCount());
-
-        Index col = 0, row = 0;
-
-        // need unique(sort) maybe to slow
-//        std::vector < std::vector< Index > > idxMap(mesh.nodeCount());
-//         for (std::vector < std::vector< Index > >::iterator mIt = idxMap.begin(); mIt != idxMap.end(); mIt++){
-//             (*mIt).reserve(100);
-//         }
-
-// using set is by a factor of approx 5 more expensive
-        std::vector < std::set< Index > > idxMap(mesh.nodeCount());
-
-        Cell *cell = 0;
-        uint nc = 0;
-
-        for (uint c = 0; c < mesh.cellCount(); c ++){
-            cell = &mesh.cell(c);
-            nc = cell->nodeCount();
+    /*! Build the value positions of all cells and boundaries of the mesh
+     * for the current sparsity pattern, used by \ref addCell and
+     * \ref addBoundary. The map is kept until the pattern changes. */
+    void buildScatterMap(const Mesh & mesh){
+        buildScatterMap(mesh, meshPatternHash(mesh));
+    }
 
-            for (uint i = 0; i < nc; i ++){
-                for (uint j = 0; j < nc; j ++){
-                    row = cell->node(i).id();
-                    col = cell->node(j).id();
-                    //idxMap[col].push_back(row);
-                    idxMap[col].insert(row);
-                    //S[col][row] = 1;
-                }
-            }
-        }
+    /*! Build the scatter map for the mesh with known \ref meshPatternHash. */
+    void buildScatterMap(const Mesh & mesh, Index hash){
+        if (!valid_) SPARSE_NOT_VALID;
+        std::shared_ptr< ElementScatterMap< IndexType > > map(
+            new ElementScatterMap< IndexType >());
+        map->build(mesh, hash, rows_, &colPtr_[0],
+                   rowIdx_.empty() ? 0 : &rowIdx_[0]);
+        scatterMap_ = map;
+    }
 
-        int nVals = 0;
-        for (std::vector < std::set< Index > >::iterator mIt = idxMap.begin();
-             mIt != idxMap.end(); mIt++){
-            //std::sort((*mIt).begin(), (*mIt).end());
-            nVals += (*mIt).size();
-        }
+    /*! Return true if there is a scatter map for this mesh. */
+    bool hasScatterMap(const Mesh & mesh) const {
+        return hasScatterMap(mesh, meshPatternHash(mesh));
+    }
 
-//         std::cout << "timwe: " << swatch.duration( true) << std::endl;
-//         exit(0);
+    /*! Return true if there is a scatter map for this mesh with known
+     * \ref meshPatternHash. */
+    bool hasScatterMap(const Mesh & mesh, Index hash) const {
+        return scatterMap_ && scatterMap_->valid(mesh, hash);
+    }
 
-        rowIdx_.reserve(nVals);
-        rowIdx_.resize(nVals);
-        vals_.resize(nVals);
+    /*! Return the scatter map, see \ref buildScatterMap. Copies of the
+     * matrix share it. */
+    const ElementScatterMap< IndexType > & scatterMap() const {
+        static const ElementScatterMap< IndexType > empty;
+        return scatterMap_ ? *scatterMap_ : empty;
+    }
 
-        colPtr_[0] = 0;
-        Index k = 0;
-        row = 0;
-        for (std::vector < std::set< Index > >::iterator mIt = idxMap.begin(); mIt != idxMap.end(); mIt++){
-            for (std::set< Index >::iterator sIt = (*mIt).begin(); sIt != (*mIt).end(); sIt++){
-                rowIdx_[k] = (*sIt);
-                vals_[k] = (ValueType)0.0;
-                k++;
-            }
-            row++;
-            colPtr_[row] = k;
+    /*! Build the sparsity pattern for the node connections of all cells
+     * in the mesh. Optionally build the scatter map too. The last pattern
+     * is cached for the mesh, see \ref SparsityPatternCache. */
+    void buildSparsityPattern(const Mesh & mesh, bool scatterMap=false){
+        Index hash = meshPatternHash(mesh);
+        if (!cachedPattern_(mesh, hash, colPtr_, rowIdx_,
+                            scatterMap ? &scatterMap_ : 0)){
+            buildMeshSparsityPattern(mesh, colPtr_, rowIdx_);
+            cachePattern_(mesh, hash, colPtr_, rowIdx_, 0);
         }
+        vals_.resize(rowIdx_.size());
         valid_ = true;
+        this->clean();
 
         rows_ = colPtr_.size() - 1;
         cols_ = max(rowIdx_) + 1;
-        //** freeing idxMap ist expensive
+        T_.invalidate();
+
+        if (scatterMap){
+            if (!hasScatterMap(mesh, hash)){
+                buildScatterMap(mesh, hash);
+                cachePattern_(mesh, hash, colPtr_, rowIdx_, &scatterMap_);
+            }
+        } else {
+            scatterMap_.reset();
+        }
     }
 
     void fillStiffnessMatrix(const Mesh & mesh){
@@ -1040,14 +1814,16 @@ public:
 
     void fillStiffnessMatrix(const Mesh & mesh, const RVector & a){
         clean();
-        buildSparsityPattern(mesh);
-        ElementMatrix < double > A_l;
-
-        for (uint i = 0; i < mesh.cellCount(); i ++){
-            A_l.ux2uy2uz2(mesh.cell(i));
-            A_l *= a[mesh.cell(i).id()];
-            *this += A_l;
-        }
+        buildSparsityPattern(mesh, true);
+
+        assembleCells(mesh, [&a](const Cell & cell,
+                                 ElementMatrix < double > & A_l,
+                                 ElementMatrix < double > & tmp,
+                                 ValueType & scale) -> bool {
+            A_l.ux2uy2uz2(cell);
+            scale = a[cell.id()];
+            return true;
+        });
     }
     void fillMassMatrix(const Mesh & mesh){
         RVector a(mesh.cellCount(), 1.0);
@@ -1056,26 +1832,28 @@ public:
 
     void fillMassMatrix(const Mesh & mesh, const RVector & a){
         clean();
-        buildSparsityPattern(mesh);
-        ElementMatrix < double > A_l;
-
-        for (uint i = 0; i < mesh.cellCount(); i ++){
-            A_l.u2(mesh.cell(i));
-            A_l *= a[mesh.cell(i).id()];
-            *this += A_l;
-        }
+        buildSparsityPattern(mesh, true);
+
+        assembleCells(mesh, [&a](const Cell & cell,
+                                 ElementMatrix < double > & A_l,
+                                 ElementMatrix < double > & tmp,
+                                 ValueType & scale) -> bool {
+            A_l.u2(cell);
+            scale = a[cell.id()];
+            return true;
+        });
     }
 
     /*! symmetric type. 0 = nonsymmetric, -1 symmetric lower part, 1 symmetric upper part.*/
     inline int stype() const {return stype_;}
 
-    inline int * colPtr() { if (valid_) return &colPtr_[0]; else SPARSE_NOT_VALID;  return 0; }
-    inline const int & colPtr() const { if (valid_) return colPtr_[0]; else SPARSE_NOT_VALID; return colPtr_[0]; }
-    inline const std::vector < int > & vecColPtr() const { return colPtr_; }
+    inline IndexType * colPtr() { T_.invalidate(); if (valid_) return &colPtr_[0]; else SPARSE_NOT_VALID;  return 0; }
+    inline const IndexType & colPtr() const { if (valid_) return colPtr_[0]; else SPARSE_NOT_VALID; return colPtr_[0]; }
+    inline const std::vector < IndexType > & vecColPtr() const { return colPtr_; }
 
-    inline int * rowIdx() { if (valid_) return &rowIdx_[0]; else SPARSE_NOT_VALID; return 0; }
-    inline const int & rowIdx() const { if (valid_) return rowIdx_[0]; else SPARSE_NOT_VALID; return rowIdx_[0]; }
-    inline const std::vector < int > & vecRowIdx() const { return rowIdx_; }
+    inline IndexType * rowIdx() { T_.invalidate(); if (valid_) return &rowIdx_[0]; else SPARSE_NOT_VALID; return 0; }
+    inline const IndexType & rowIdx() const { if (valid_) return rowIdx_[0]; else SPARSE_NOT_VALID; return rowIdx_[0]; }
+    inline const std::vector < IndexType > & vecRowIdx() const { return rowIdx_; }
 
     inline ValueType * vals() { if (valid_) return &vals_[0]; else SPARSE_NOT_VALID; return 0; }
 //     inline const ValueType * vals() const { if (valid_) return &vals_[0]; else SPARSE_NOT_VALID; return 0; }
@@ -1099,7 +1877,7 @@ public:
         file.precision(14);
 
         for (Index i = 0; i < size(); i++){
-            for (SIndex j = colPtr_[i]; j < colPtr_[i + 1]; j ++){
+            for (IndexType j = colPtr_[i]; j < colPtr_[i + 1]; j ++){
                 file << i << "\t" << rowIdx_[j]
                           << "\t" << vals_[j] << std::endl;
             }
@@ -1111,43 +1889,115 @@ public:
 
 protected:
 
-    // int to be cholmod compatible!!!!!!!!
+    /*! Take the CRS arrays of the finalized map matrix. Throws if the
+     * number of values does not fit into IndexType. */
+    template < class V >
+    void copyCRS_(const SparseMapMatrix< V, Index > & S){
+        this->clear();
+        cols_ = S.cols();
+        rows_ = S.rows();
+        stype_  = S.stype();
+
+        // the finalized map matrix is already sorted row by row
+        const std::vector< Index > & rowPtr = S.crsRowPtr();
+        const std::vector< Index > & colIdx = S.crsColIdx();
+        const std::vector< V > & vals = S.crsVals();
+
+        checkIndexRange< IndexType >(max(colIdx.size(), Index(S.cols())),
+                                     WHERE_AM_I);
+
+        colPtr_.resize(S.rows() + 1);
+        for (Index i = 0; i < colPtr_.size(); i ++){
+            colPtr_[i] = rowPtr[min(i, Index(rowPtr.size() - 1))];
+        }
+        rowIdx_.resize(colPtr_.back());
+        vals_.resize(colPtr_.back());
+
+        for (Index k = 0; k < rowIdx_.size(); k ++){
+            rowIdx_[k] = colIdx[k];
+            vals_[k] = vals[k];
+        }
+        valid_ = true;
+    }
+
+    /*! Get the pattern from the \ref SparsityPatternCache. */
+    bool cachedPattern_(const Mesh & mesh, Index hash,
+                        std::vector< int > & rowPtr, std::vector< int > & colIdx,
+                        std::shared_ptr< const ElementScatterMap< int > > * map){
+        return SparsityPatternCache::instance().get(mesh, hash, rowPtr, colIdx, map);
+    }
+    /*! 64 bit patterns are not cached. */
+    bool cachedPattern_(const Mesh & mesh, Index hash,
+                        std::vector< SIndex > & rowPtr, std::vector< SIndex > & colIdx,
+                        std::shared_ptr< const ElementScatterMap< SIndex > > * map){
+        if (map) map->reset();
+        return false;
+    }
+    void cachePattern_(const Mesh & mesh, Index hash,
+                       const std::vector< int > & rowPtr,
+                       const std::vector< int > & colIdx,
+                       const std::shared_ptr< const ElementScatterMap< int > > * map){
+        SparsityPatternCache::instance().set(mesh, hash, rowPtr, colIdx, map);
+    }
+    void cachePattern_(const Mesh & mesh, Index hash,
+                       const std::vector< SIndex > & rowPtr,
+                       const std::vector< SIndex > & colIdx,
+                       const std::shared_ptr< const ElementScatterMap< SIndex > > * map){ }
+
+    void addScattered_(const Index * idx, const ElementMatrix< double > & A,
+                       const ValueType & scale){
+        if (!idx || !A.oldStyle() || A.cols() != A.size()){
+            this->add(A, scale);
+            return;
+        }
+        for (Index i = 0, n = A.size(); i < n; i++){
+            for (Index j = 0; j < n; j++){
+                vals_[idx[i * n + j]] += scale * A.getVal(i, j);
+            }
+        }
+    }
 
-    std::vector < int > colPtr_;
-    std::vector < int > rowIdx_;
+    // int or SIndex to be cholmod compatible (CHOLMOD_INT or CHOLMOD_LONG)
+    std::vector < IndexType > colPtr_;
+    std::vector < IndexType > rowIdx_;
     Vector < ValueType > vals_;
 
     bool valid_;
     int stype_;
     Index rows_;
     Index cols_;
+
+    // transposed pattern for threaded transMult and symmetric mult
+    mutable CRSTransposedPattern< IndexType > T_;
+    // value positions of mesh entities for assembling, shared by copies
+    std::shared_ptr< const ElementScatterMap< IndexType > > scatterMap_;
 };
 
-template < class ValueType >
-SparseMatrix< ValueType > operator + (const SparseMatrix< ValueType > & A,
-                                      const SparseMatrix< ValueType > & B){
-    SparseMatrix< ValueType > ret(A);
+template < class ValueType, class IndexType >
+SparseMatrix< ValueType, IndexType > operator + (const SparseMatrix< ValueType, IndexType > & A,
+                                      const SparseMatrix< ValueType, IndexType > & B){
+    SparseMatrix< ValueType, IndexType > ret(A);
     return ret += B;
 }
 
-template < class ValueType >
-SparseMatrix< ValueType > operator - (const SparseMatrix< ValueType > & A,
-                                      const SparseMatrix< ValueType > & B){
-    SparseMatrix< ValueType > ret(A);
+template < class ValueType, class IndexType >
+SparseMatrix< ValueType, IndexType > operator - (const SparseMatrix< ValueType, IndexType > & A,
+                                      const SparseMatrix< ValueType, IndexType > & B){
+    SparseMatrix< ValueType, IndexType > ret(A);
     return ret -= B;
 }
 
-template < class ValueType >
-SparseMatrix < ValueType > operator * (const SparseMatrix < ValueType > & A,
+template < class ValueType, class IndexType >
+SparseMatrix < ValueType, IndexType > operator * (const SparseMatrix < ValueType, IndexType > & A,
                                        const ValueType & b){
-    SparseMatrix< ValueType > ret(A);
+    SparseMatrix< ValueType, IndexType > ret(A);
     return ret *= b;
 }
 
-template < class ValueType >
-SparseMatrix < ValueType > operator * (const ValueType & b,
-                                       const SparseMatrix < ValueType > & A){
-    SparseMatrix< ValueType > ret(A);
+template < class ValueType, class IndexType >
+SparseMatrix < ValueType, IndexType > operator * (const ValueType & b,
+                                       const SparseMatrix < ValueType, IndexType > & A){
+    SparseMatrix< ValueType, IndexType > ret(A);
     return ret *= b;
 }
 
@@ -1175,10 +2025,36 @@ inline RSparseMatrix imag(const CSparseMatrix & A){
 }
 
 /*! SparseMatrix specialized type traits in sparsematrix.cpp */
-template< typename ValueType >
-void SparseMatrix< ValueType >::copy_(const SparseMapMatrix< double, Index > & S){THROW_TO_IMPL}
-template< typename ValueType >
-void SparseMatrix< ValueType >::copy_(const SparseMapMatrix< Complex, Index > & S){THROW_TO_IMPL}
+template< typename ValueType, typename IndexType >
+void SparseMatrix< ValueType, IndexType >::copy_(const SparseMapMatrix< double, Index > & S){THROW_TO_IMPL}
+template< typename ValueType, typename IndexType >
+void SparseMatrix< ValueType, IndexType >::copy_(const SparseMapMatrix< Complex, Index > & S){THROW_TO_IMPL}
+
+template< typename ValueType, typename IndexType >
+void SparseMatrix< ValueType, IndexType >::add(const ElementMatrix< double > & A,
+                                               ValueType scale){
+    if (!valid_) SPARSE_NOT_VALID;
+    if (A.oldStyle()){
+        for (Index i = 0, imax = A.size(); i < imax; i++){
+            for (Index j = 0, jmax = A.size(); j < jmax; j++){
+                addVal(A.idx(i), A.idx(j), scale * A.getVal(i, j));
+            }
+        }
+    } else {
+        A.integrate();
+        for (Index i = 0, imax = A.rows(); i < imax; i++){
+            for (Index j = 0, jmax = A.cols(); j < jmax; j++){
+                addVal(A.rowIDs()[i], A.colIDs()[j], scale * A.getVal(i, j));
+            }
+        }
+    }
+}
+template< typename ValueType, typename IndexType >
+void SparseMatrix< ValueType, IndexType >::add(const ElementMatrix< double > & A,
+                                               const Pos & scale){THROW_TO_IMPL}
+template< typename ValueType, typename IndexType >
+void SparseMatrix< ValueType, IndexType >::add(const ElementMatrix< double > & A,
+                                               const Matrix < ValueType > & scale){THROW_TO_IMPL}
 
 /*! SparseMapMatrix specialized type traits in sparsematrix.cpp */
 template <> DLLEXPORT void SparseMapMatrix< double, Index >::copy_(const SparseMatrix<double> & S);
@@ -1220,6 +2096,8 @@ template <> DLLEXPORT void SparseMapMatrix< Complex, Index >::
 
 template <> DLLEXPORT void SparseMatrix<double>::copy_(const SparseMapMatrix< double, Index > & S);
 template <> DLLEXPORT void SparseMatrix<Complex>::copy_(const SparseMapMatrix< Complex, Index > & S);
+template <> DLLEXPORT void SparseMatrix<double, SIndex>::copy_(const SparseMapMatrix< double, Index > & S);
+template <> DLLEXPORT void SparseMatrix<Complex, SIndex>::copy_(const SparseMapMatrix< Complex, Index > & S);
 
 template <> DLLEXPORT void SparseMatrix< double >::
     add(const ElementMatrix < double > & A, double scale);
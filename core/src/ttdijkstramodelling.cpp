@@ -518,6 +518,7 @@ void TravelTimeDijkstraModelling::createJacobian(RSparseMapMatrix & jacobian,
     jacobian.clear();
     jacobian.setRows(nData);
     jacobian.setCols(nModel);
+    jacobian.setBuildMode(true);
 
     //** for each shot: vector<  way(shot->geoph) >;
     wayMatrix_.clear();
@@ -577,6 +578,7 @@ void TravelTimeDijkstraModelling::createJacobian(RSparseMapMatrix & jacobian,
             }
         }
     }
+    jacobian.setBuildMode(false);
     if (this->verbose()){
         std::cout << "/" << swatch.duration(true) << " ";
     }
@@ -7,6 +7,11 @@
 #include <meshentities.h>
 #include <elementmatrix.h>
 #include <integration.h>
+#include <sparsematrix.h>
+#include <linSolver.h>
+#include <cholmodWrapper.h>
+#include <meshgenerators.h>
+#include <set>
 
 class FEMTest : public CppUnit::TestFixture  {
     CPPUNIT_TEST_SUITE(FEMTest);
@@ -17,6 +22,11 @@ class FEMTest : public CppUnit::TestFixture  {
     CPPUNIT_TEST(testFEM1D);
     CPPUNIT_TEST(testFEM2D);
     CPPUNIT_TEST(testFEM3D);
+    CPPUNIT_TEST(testAssemblyScatter);
+    CPPUNIT_TEST(testSparsityPattern);
+    CPPUNIT_TEST(testAssemblyMT);
+    CPPUNIT_TEST(testConstantCoefficient);
+    CPPUNIT_TEST(testSparseMatrix64);
 
     CPPUNIT_TEST_SUITE_END();
 
@@ -79,6 +89,219 @@ public:
         testStiffness3D();
     }
 
+    void testAssemblyScatter(){
+        GIMLI::Mesh mesh(GIMLI::createMesh2D(4, 3));
+        GIMLI::RVector a(cellCoefficients_(mesh));
+
+        // scatter map need to give the same matrix like pattern search
+        GIMLI::RSparseMatrix S1;
+        S1.fillStiffnessMatrix(mesh, a);
+        CPPUNIT_ASSERT(S1.hasScatterMap(mesh));
+
+        GIMLI::RSparseMatrix S2;
+        S2.buildSparsityPattern(mesh);
+        CPPUNIT_ASSERT(!S2.hasScatterMap(mesh));
+
+        GIMLI::ElementMatrix< double > A;
+        for (GIMLI::Index i = 0; i < mesh.cellCount(); i ++){
+            A.ux2uy2uz2(mesh.cell(i));
+            S2.add(A, a[i]);
+        }
+        CPPUNIT_ASSERT(S1.vecVals() == S2.vecVals());
+
+        for (GIMLI::Index i = 0; i < mesh.boundaryCount(); i ++){
+            A.u2(mesh.boundary(i));
+            S1.addBoundary(i, A, 2.0);
+            S2.add(A, 2.0);
+        }
+        CPPUNIT_ASSERT(S1.vecVals() == S2.vecVals());
+
+        // copies share the map
+        GIMLI::RSparseMatrix S3(S1);
+        CPPUNIT_ASSERT(S3.hasScatterMap(mesh));
+        CPPUNIT_ASSERT(&S3.scatterMap() == &S1.scatterMap());
+
+        // the map is checked against the given mesh, not the counts
+        GIMLI::Mesh mesh2(mesh);
+        mesh2.node(1).setPos(mesh2.node(1).pos() + GIMLI::RVector3(0.1, 0.0));
+        CPPUNIT_ASSERT(!S1.hasScatterMap(mesh2));
+
+        S3.clear();
+        CPPUNIT_ASSERT(!S3.hasScatterMap(mesh));
+        CPPUNIT_ASSERT(S1.hasScatterMap(mesh));
+
+        // mesh data and markers do not touch the key
+        GIMLI::Index key = GIMLI::meshPatternHash(mesh);
+        mesh.addData("att", GIMLI::RVector(mesh.cellCount(), 2.0));
+        mesh.cell(0).setMarker(3);
+        CPPUNIT_ASSERT(GIMLI::meshPatternHash(mesh) == key);
+        CPPUNIT_ASSERT(S1.hasScatterMap(mesh));
+
+        // same nodes but other cells need their own pattern
+        GIMLI::Mesh m1(2), m2(2);
+        for (GIMLI::Mesh * m: {&m1, &m2}){
+            m->createNode(0.0, 0.0, 0.0);
+            m->createNode(1.0, 0.0, 0.0);
+            m->createNode(1.0, 1.0, 0.0);
+            m->createNode(0.0, 1.0, 0.0);
+        }
+        m1.createTriangle(m1.node(0), m1.node(1), m1.node(2));
+        m1.createTriangle(m1.node(0), m1.node(2), m1.node(3));
+        m2.createTriangle(m2.node(0), m2.node(1), m2.node(3));
+        m2.createTriangle(m2.node(1), m2.node(2), m2.node(3));
+        CPPUNIT_ASSERT(GIMLI::meshPatternHash(m1) != GIMLI::meshPatternHash(m2));
+
+        GIMLI::RSparseMatrix P1, P2;
+        P1.buildSparsityPattern(m1, true);
+        P2.buildSparsityPattern(m2, true);
+        CPPUNIT_ASSERT(P2.vecRowIdx() != P1.vecRowIdx());
+        CPPUNIT_ASSERT(P2.hasScatterMap(m2));
+    }
+
+    void testSparsityPattern(){
+        // 11520 cell nodes, enough to build the pattern threaded
+        GIMLI::Mesh mesh(GIMLI::createMesh3D(12, 10, 12));
+
+        // reference: all node pairs of all cells
+        std::vector < std::set< int > > rows(mesh.nodeCount());
+        for (GIMLI::Index c = 0; c < mesh.cellCount(); c ++){
+            for (GIMLI::Index i = 0; i < mesh.cell(c).nodeCount(); i ++){
+                for (GIMLI::Index j = 0; j < mesh.cell(c).nodeCount(); j ++){
+                    rows[mesh.cell(c).node(i).id()].insert(mesh.cell(c).node(j).id());
+                }
+            }
+        }
+        std::vector < int > rowPtr(1, 0), colIdx;
+        for (GIMLI::Index i = 0; i < rows.size(); i ++){
+            colIdx.insert(colIdx.end(), rows[i].begin(), rows[i].end());
+            rowPtr.push_back(colIdx.size());
+        }
+
+        GIMLI::Index oldThreads = GIMLI::threadCount();
+        for (GIMLI::Index nThreads: {1, 3}){
+            GIMLI::setThreadCount(nThreads);
+            GIMLI::SparsityPatternCache::instance().clear();
+            std::vector < int > p, c;
+            GIMLI::buildMeshSparsityPattern(mesh, p, c);
+            CPPUNIT_ASSERT(p == rowPtr);
+            CPPUNIT_ASSERT(c == colIdx);
+        }
+        GIMLI::setThreadCount(oldThreads);
+
+        // second call on the same mesh is served from the cache
+        GIMLI::RSparseMatrix S1, S2;
+        S1.buildSparsityPattern(mesh);
+        S2.buildSparsityPattern(mesh, true);
+        CPPUNIT_ASSERT(S1.vecColPtr() == rowPtr);
+        CPPUNIT_ASSERT(S2.vecRowIdx() == colIdx);
+        CPPUNIT_ASSERT(S2.hasScatterMap(mesh));
+        CPPUNIT_ASSERT(S2.nVals() == colIdx.size());
+    }
+
+    void testSparseMatrix64(){
+        GIMLI::Mesh mesh(GIMLI::createMesh3D(6, 5, 4));
+        GIMLI::RVector a(mesh.cellCount());
+        for (GIMLI::Index i = 0; i < a.size(); i ++) a[i] = 1.0 + i;
+
+        GIMLI::RSparseMatrix S;
+        GIMLI::RSparseMatrix64 S64;
+        S.fillStiffnessMatrix(mesh, a);
+        S64.fillStiffnessMatrix(mesh, a);
+        CPPUNIT_ASSERT(S64.hasScatterMap(mesh));
+        CPPUNIT_ASSERT(S64.vecVals() == S.vecVals());
+        CPPUNIT_ASSERT(S64.vecColPtr().back() == S.vecColPtr().back());
+
+        GIMLI::RVector x(mesh.nodeCount());
+        for (GIMLI::Index i = 0; i < x.size(); i ++) x[i] = std::sin(0.1 * i);
+        CPPUNIT_ASSERT(S64.mult(x) == S.mult(x));
+        CPPUNIT_ASSERT(S64.transMult(x) == S.transMult(x));
+
+        GIMLI::RSparseMapMatrix M;
+        GIMLI::createStiffnessMatrix(mesh, 1, M, a, 1, 0);
+        GIMLI::RSparseMatrix64 M64(M);
+        CPPUNIT_ASSERT(M64.nVals() == M.nVals());
+        CPPUNIT_ASSERT(GIMLI::norml2(M64.mult(x) - M.mult(x)) < 1e-12 * GIMLI::norml2(M.mult(x)));
+
+        // 64 bit matrices are solved with CHOLMOD only
+        S.setVal(0, 0, S.getVal(0, 0) + 1.0);
+        S64.setVal(0, 0, S64.getVal(0, 0) + 1.0);
+        GIMLI::LinSolver solver64;
+        if (GIMLI::CHOLMODWrapper::valid()){
+            GIMLI::LinSolver solver(S, GIMLI::CHOLMOD);
+            solver64.setMatrix(S64);
+            GIMLI::RVector u(solver.solve(x));
+            CPPUNIT_ASSERT(GIMLI::norml2(solver64.solve(x) - u) < 1e-10 * GIMLI::norml2(u));
+        } else {
+            CPPUNIT_ASSERT_THROW(solver64.setMatrix(S64), std::exception);
+        }
+
+        CPPUNIT_ASSERT_NO_THROW(GIMLI::checkIndexRange< GIMLI::SIndex >(GIMLI::Index(1) << 40, ""));
+        CPPUNIT_ASSERT_THROW(GIMLI::checkIndexRange< int >(GIMLI::Index(1) << 31, ""),
+                             std::length_error);
+    }
+
+    void testAssemblyMT(){
+        GIMLI::Mesh mesh(GIMLI::createMesh3D(22, 22, 22));
+        CPPUNIT_ASSERT(mesh.cellCount() >= GIMLI::SPARSE_ASSEMBLY_MT_MIN_CELLS);
+        GIMLI::RVector a(mesh.cellCount());
+        for (GIMLI::Index i = 0; i < a.size(); i ++) a[i] = 1.0 + (i % 7);
+
+        GIMLI::Index oldThreads = GIMLI::threadCount();
+        GIMLI::RSparseMatrix S1, S4, S4b;
+        GIMLI::RSparseMapMatrix M1, M4;
+
+        GIMLI::setThreadCount(1);
+        S1.fillStiffnessMatrix(mesh, a);
+        GIMLI::createStiffnessMatrix(mesh, 1, M1, a, 1, 0);
+
+        GIMLI::setThreadCount(4);
+        S4.fillStiffnessMatrix(mesh, a);
+        S4b.fillStiffnessMatrix(mesh, a);
+        GIMLI::createStiffnessMatrix(mesh, 1, M4, a, 1, 0);
+        GIMLI::setThreadCount(oldThreads);
+
+        // cell colors: no cell shares a node with another one of its color
+        std::vector < GIMLI::IndexArray > colors;
+        GIMLI::colorMeshCells(mesh, colors);
+        GIMLI::Index nColored = 0;
+        for (GIMLI::Index i = 0; i < colors.size(); i ++){
+            std::set < GIMLI::Index > nodes;
+            for (GIMLI::Index c: colors[i]){
+                for (GIMLI::Index j = 0; j < mesh.cell(c).nodeCount(); j ++){
+                    CPPUNIT_ASSERT(nodes.insert(mesh.cell(c).node(j).id()).second);
+                }
+            }
+            nColored += colors[i].size();
+        }
+        CPPUNIT_ASSERT(nColored == mesh.cellCount());
+
+        // reproducible for a fixed number of threads
+        CPPUNIT_ASSERT(S4.vecVals() == S4b.vecVals());
+        CPPUNIT_ASSERT(GIMLI::norml2(S4.vecVals() - S1.vecVals()) <
+                       1e-12 * GIMLI::norml2(S1.vecVals()));
+        // map assembly keeps the serial order
+        CPPUNIT_ASSERT(M1.crsVals() == M4.crsVals());
+        CPPUNIT_ASSERT(M1.crsColIdx() == M4.crsColIdx());
+    }
+
+    void testConstantCoefficient(){
+        GIMLI::Mesh mesh(GIMLI::createMesh2D(8, 6));
+        GIMLI::RVector a(mesh.cellCount(), 2.0);
+        std::vector< GIMLI::RVector > a0(1, GIMLI::RVector(1, 2.0));
+
+        // one value for all cells gives the matrices of the per cell values
+        GIMLI::RSparseMapMatrix M1, M2, K1, K2;
+        GIMLI::createMassMatrix(mesh, 1, M1, a0, 1, 0);
+        GIMLI::createMassMatrix(mesh, 1, M2, a, 1, 0);
+        GIMLI::createStiffnessMatrix(mesh, 1, K1, a0, 1, 0);
+        GIMLI::createStiffnessMatrix(mesh, 1, K2, a, 1, 0);
+
+        CPPUNIT_ASSERT(M1.crsColIdx() == M2.crsColIdx());
+        CPPUNIT_ASSERT(M1.crsVals() == M2.crsVals());
+        CPPUNIT_ASSERT(K1.crsColIdx() == K2.crsColIdx());
+        CPPUNIT_ASSERT(K1.crsVals() == K2.crsVals());
+    }
+
     void testStiffness1D(){
 
         std::vector < GIMLI::Node * > n(2);
@@ -486,6 +709,14 @@ public:
         nodes_.clear();
     }
 
+protected:
+    /*! Coefficients 1, 2, 3, ... for the cells of mesh. */
+    GIMLI::RVector cellCoefficients_(const GIMLI::Mesh & mesh) const {
+        GIMLI::RVector a(mesh.cellCount());
+        for (GIMLI::Index i = 0; i < a.size(); i ++) a[i] = 1.0 + i;
+        return a;
+    }
+
 private:
     std::vector < GIMLI::Node * > nodes_;
     //* n1_, * n2_, * n3_, * n4_, * n5_, * n6_, * n7_, * n8_;
@@ -30,6 +30,7 @@ class VectorTest : public CppUnit::TestFixture  {
     CPPUNIT_TEST(testMatrix);
     CPPUNIT_TEST(testBlockMatrix);
     CPPUNIT_TEST(testSparseMapMatrix);
+    CPPUNIT_TEST(testSparseMultMT);
     CPPUNIT_TEST(testFind);
     CPPUNIT_TEST(testIO);
 
@@ -541,6 +542,115 @@ public:
 
         D.cleanRow(1);
         CPPUNIT_ASSERT(D.col(2) == GIMLI::RVector(std::vector< double >{1., 0., 1.}));
+
+        // build mode need to give the same matrix like direct map access
+        GIMLI::RSparseMapMatrix E(3, 4);
+        GIMLI::RSparseMapMatrix F(3, 4);
+        F.setBuildMode(true);
+        for (GIMLI::Index i = 0; i < 20; i ++ ){
+            E[i % 3][(i * 7) % 4] += i;
+            F[i % 3][(i * 7) % 4] += i;
+            E[(i * 5) % 3][i % 4] = -1.0 * i;
+            F[(i * 5) % 3][i % 4] = -1.0 * i;
+        }
+        CPPUNIT_ASSERT(F.getVal(1, 2) == E.getVal(1, 2));
+        E.addVal(2, 3, 3.14);
+        F.addVal(2, 3, 3.14);
+        GIMLI::RVector x(std::vector< double >{1., 2., 3., 4.});
+        GIMLI::RVector y(std::vector< double >{1., 2., 3.});
+        CPPUNIT_ASSERT(F.mult(x) == E.mult(x));
+        CPPUNIT_ASSERT(F.transMult(y) == E.transMult(y));
+        F.setBuildMode(false);
+        CPPUNIT_ASSERT(F.nVals() == E.nVals());
+        GIMLI::RSparseMatrix S(F);
+        CPPUNIT_ASSERT(S.mult(x) == E.mult(x));
+
+        // writes to known entries keep the CRS arrays
+        const double * vals = &F.crsVals()[0];
+        for (GIMLI::Index i = 0; i < 10; i ++ ){
+            F[1][2] += 1.0;
+            E[1][2] += 1.0;
+            F.setVal(2, 3, i);
+            E.setVal(2, 3, i);
+            CPPUNIT_ASSERT(F.mult(x) == E.mult(x));
+        }
+        F *= 2.0;
+        E *= 2.0;
+        CPPUNIT_ASSERT(&F.crsVals()[0] == vals);
+        CPPUNIT_ASSERT(F.transMult(y) == E.transMult(y));
+        CPPUNIT_ASSERT(F.getVal(1, 2) == E.getVal(1, 2));
+        // a new entry
+        F.setVal(3, 1, 1.0);
+        E.setVal(3, 1, 1.0);
+        CPPUNIT_ASSERT(F.mult(x) == E.mult(x));
+        CPPUNIT_ASSERT(F.nVals() == E.nVals());
+        CPPUNIT_ASSERT(F.getVal(3, 1) == 1.0);
+
+        // symmetric storage, transMult of a real matrix equals mult
+        GIMLI::RSparseMapMatrix U(3, 3, -1);
+        U.setVal(0, 0, 1.0);
+        U.setVal(0, 2, 2.0);
+        U.setVal(1, 1, 3.0);
+        U.setVal(1, 2, 4.0);
+        U.setVal(2, 2, 5.0);
+        CPPUNIT_ASSERT(U.mult(y) == GIMLI::RVector(std::vector< double >{7., 18., 25.}));
+        CPPUNIT_ASSERT(U.transMult(y) == U.mult(y));
+        GIMLI::RSparseMatrix Us(U);
+        CPPUNIT_ASSERT(Us.transMult(y) == U.mult(y));
+    }
+
+    void testSparseMultMT(){
+        // enough values for the threaded products
+        GIMLI::Index n = 30000;
+        GIMLI::RSparseMapMatrix A(n, n), U(n, n, -1);
+        A.setBuildMode(true);
+        U.setBuildMode(true);
+        for (GIMLI::Index i = 0; i < n; i ++){
+            for (GIMLI::Index j: {i, (i * 7 + 3) % n, (i * 13 + 5) % n, (i + 1) % n}){
+                A.addVal(i, j, std::sin(1.0 + i + 0.1 * j));
+                U.addVal(std::min(i, j), std::max(i, j), std::cos(1.0 + i + 0.1 * j));
+            }
+        }
+        A.setBuildMode(false);
+        U.setBuildMode(false);
+        CPPUNIT_ASSERT(A.nVals() > GIMLI::SPARSE_MULT_MT_MIN_VALS);
+        CPPUNIT_ASSERT(U.nVals() > GIMLI::SPARSE_MULT_MT_MIN_VALS);
+        GIMLI::RSparseMatrix S(A), Us(U);
+
+        GIMLI::RVector x(n);
+        for (GIMLI::Index i = 0; i < n; i ++) x[i] = std::sin(0.37 * i);
+
+        GIMLI::Index oldThreads = GIMLI::threadCount();
+        GIMLI::RVector r[3][6];
+        GIMLI::Index threads[3] = {1, 2, 4};
+        for (GIMLI::Index t = 0; t < 3; t ++){
+            GIMLI::setThreadCount(threads[t]);
+            r[t][0] = A.mult(x);
+            r[t][1] = A.transMult(x);
+            r[t][2] = U.mult(x);
+            r[t][3] = U.transMult(x);
+            r[t][4] = S.transMult(x);
+            r[t][5] = Us.mult(x);
+        }
+        for (GIMLI::Index k = 0; k < 6; k ++){
+            // the threaded results do not depend on the number of threads
+            CPPUNIT_ASSERT(r[2][k] == r[1][k]);
+            CPPUNIT_ASSERT(GIMLI::norml2(r[1][k] - r[0][k]) < 1e-12 * GIMLI::norml2(r[0][k]));
+        }
+        CPPUNIT_ASSERT(r[1][4] == r[1][1]);
+        CPPUNIT_ASSERT(GIMLI::norml2(r[1][2] - r[1][3]) < 1e-12 * GIMLI::norml2(r[1][2]));
+
+        // new pattern with the same size and number of values
+        GIMLI::setThreadCount(4);
+        int * col = S.rowIdx();
+        for (GIMLI::Index k = 0; k < S.nVals(); k ++) col[k] = (col[k] + 1) % n;
+        CPPUNIT_ASSERT(GIMLI::norml2(S.transMult(x) - r[1][1]) > 0.0);
+        // serial scatter and threaded gather sum each column in row order
+        GIMLI::setThreadCount(1);
+        GIMLI::RVector rs(S.transMult(x));
+        GIMLI::setThreadCount(4);
+        CPPUNIT_ASSERT(S.transMult(x) == rs);
+        GIMLI::setThreadCount(oldThreads);
     }
 
     void testIO(){